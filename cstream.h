@@ -1,19 +1,58 @@
 #ifndef _CSTREAM_H
 #define _CSTREAM_H
 
+#if defined(LINUX) && !defined(_GNU_SOURCE)
+// O_DIRECT and friends
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include "../ctest/ctest.h"
 
+#if defined(LINUX)
+#include <sys/sendfile.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CSTREAM_X86
+#include <immintrin.h>
+#endif
+
 const static uint64_t page_size = 4096;
 const static uint64_t alloc_size = page_size * 8;
-const static uint64_t partmask = 0x80000000000000;
+const static uint64_t read_ahead_size = alloc_size * 8;
+const static uint64_t write_behind_size = alloc_size * 8;
+const static uint64_t huge_page_size = 1 << 21;
+const static uint64_t reader_size = page_size * 4;
+const static uint64_t random_size = page_size * 2;
+const static uint64_t buffer_limit_size = alloc_size * 32;
+// mapped writers double their mapping, in steps of this once past it
+const static uint64_t map_step_size = huge_page_size * 8;
+// the most we hand the kernel per copy call
+const static uint64_t copy_step_size = 1 << 30;
+#define WRITE_BEHIND_SLOTS 4
+#define LINE_INDEX_STRIDE 64
+// files we create for others to read back, rw-r--r-- before the umask
+#define SHARED_FILE_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+// refills in a row before we grow, and seeks in a row before we shrink
+#define SEQUENTIAL_FILLS 2
+#define RANDOM_SEEKS 4
+const static uint64_t partmask = 0x8000000000000000;
 
 #define next_page_multiple(s) ((s + (page_size - 1)) & ~(page_size - 1))
 #define prev_page_multiple(s) (s & ~(page_size - 1))
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
 
 static inline int is_eol_8(uint8_t *c)
 {
@@ -36,7 +75,7 @@ static inline int is_eol_8(uint8_t *c)
 
 static inline int is_eol_16(uint8_t *c)
 {
-    uint32_t c_value = (uint16_t)*c;
+    uint32_t c_value = *(uint16_t *)c;
 
     switch (c_value) {
     case 0x0000: /* term */
@@ -45,11 +84,6 @@ static inline int is_eol_16(uint8_t *c)
     case 0x000B: /*vertical tab */
     case 0x000C: /*form feed */
     case 0x000D: /*\r*/
-    case 0x0500: // big endian EOF ??
-    case 0x0A00:
-    case 0x0B00:
-    case 0x0C00:
-    case 0x0D00:
     case 0xC080: /* modified utf8 */
     case 0x80C0: /* modified utf8 */
         return 1;
@@ -64,7 +98,7 @@ static inline int is_eol_32(uint8_t *c)
     //
     // null terminator C0 80 in some odd java unicode world
     //
-    uint32_t c_value = (uint32_t)*c;
+    uint32_t c_value = *(uint32_t *)c;
 
     switch (c_value) {
     case 0x00000000: /* term */
@@ -75,11 +109,6 @@ static inline int is_eol_32(uint8_t *c)
     case 0x0000000D: /*\r*/
     case 0x0000C080: /* modified utf8 */
     case 0xC0800000: /* modified utf8 */
-    case 0x05000000: // big endian EOF ??
-    case 0x0A000000:
-    case 0x0B000000:
-    case 0x0C000000:
-    case 0x0D000000:
         return 1;
 
     default:
@@ -87,23 +116,29 @@ static inline int is_eol_32(uint8_t *c)
     };
 }
 
+static inline int is_ascii_8(uint8_t *c) { return *c < 0x80; }
+
+static inline int is_ascii_16(uint8_t *c) { return *(uint16_t *)c < 0x80; }
+
+static inline int is_ascii_32(uint8_t *c) { return *(uint32_t *)c < 0x80; }
+
 static inline int from_char_8(uint8_t *c) { return (uint8_t)*c; }
 
-static inline int from_char_16(uint8_t *c) { return (uint16_t)*c; }
+static inline int from_char_16(uint8_t *c) { return *(uint16_t *)c; }
 
-static inline int from_char_32(uint8_t *c) { return (uint32_t)*c; }
+static inline int from_char_32(uint8_t *c) { return *(uint32_t *)c; }
 
-static inline int swap_16(uint8_t *c)
+static inline uint16_t swap_16(uint8_t *c)
 {
-    uint32_t res = (uint16_t)*c;
-    return (0xff & res << 8) | (0xff & res >> 8);
+    uint16_t res = *(uint16_t *)c;
+    return (uint16_t)((res << 8) | (res >> 8));
 }
 
-static inline int swap_32(uint8_t *c)
+static inline uint32_t swap_32(uint8_t *c)
 {
-    uint32_t res = (uint32_t)*c;
-    return (0xff & (res << 24)) | (0xff00 & (res << 8)) |
-           (0xff0000 & (res >> 8)) | (0xff000000 & (res >> 24));
+    uint32_t res = *(uint32_t *)c;
+    return (0xff & (res >> 24)) | (0xff00 & (res >> 8)) |
+           (0xff0000 & (res << 8)) | (0xff000000 & (res << 24));
 }
 
 typedef enum file_stream_mode_e {
@@ -112,26 +147,108 @@ typedef enum file_stream_mode_e {
     WRITE = 2,
     APPEND = 4,
     CREATE = 8,
-    TRUNCATE = 16
+    TRUNCATE = 16,
+    MAPPED = 32,
+    READ_AHEAD = 64,
+    WRITE_BEHIND = 128,
+    DIRECT = 256,
+    TEXT = 512,
+    SPARSE = 1024
 } file_stream_mode;
 
+typedef enum fs_advice_e {
+    // adapt to the access pattern we observe
+    ADVISE_NORMAL = 0,
+    ADVISE_SEQUENTIAL = 1,
+    ADVISE_RANDOM = 2
+} fs_advice;
+
 typedef enum file_stream_type_e {
     ASCII = 1,
     UNICODE_16 = 2,
     UNICODE_32 = 4,
 } file_stream_type;
 
+/*
+    I/O statistics, compiled in with CSTREAM_STATS.
+    Every counter is a 64 bit word, so a snapshot can copy them one by one
+    while the helper threads are still counting. Latency bucket i holds
+    the calls that took [2^i, 2^(i+1)) nanoseconds.
+*/
+typedef enum fs_stats_op_e {
+    STATS_READ = 0,
+    STATS_WRITE = 1,
+    STATS_SEEK = 2,
+    STATS_OPS = 3
+} fs_stats_op;
+
+#define STATS_BUCKETS 32
+
+typedef struct fs_stats_t
+{
+    // syscalls issued, failed and bytes moved, per op
+    uint64_t calls[STATS_OPS];
+    uint64_t errors[STATS_OPS];
+    uint64_t bytes[STATS_OPS];
+    // reads that returned less than we asked for
+    uint64_t short_reads;
+    // buffer reallocations, rewinds and the bytes read again after them
+    uint64_t reallocs;
+    uint64_t rewinds;
+    uint64_t reread_bytes;
+    uint64_t latency[STATS_OPS][STATS_BUCKETS];
+} fs_stats;
+
 typedef struct file_stream_t
 {
     // file data
     int32_t fd;
+    // fd without O_DIRECT, for the unaligned tails of direct writers.
+    // -1 when fd goes through the page cache already.
+    int32_t tail_fd;
     size_t file_size;
     size_t file_ptr;
     // internal buffer data
     uint8_t *buffer;
     size_t buffer_ptr;
     size_t buffer_size;
+    size_t buffer_capacity;
     file_stream_mode mode;
+    // background reader, when reading ahead
+    struct fs_prefetch_t *prefetch;
+    // background writer, when writing behind
+    struct fs_flusher_t *flusher;
+    // line starts, once fs_seek_line needed them
+    struct fs_line_index_t *lines;
+    // the data extents of a sparse reader, NULL when it has no holes
+    struct fs_extent_t *extents;
+    uint32_t extent_count;
+    // changes with every write, tags what positional readers hold
+    uint64_t generation;
+    // a sink holding spans of our buffer, we let it send them first
+    struct fs_sink_t *sink;
+    // crc32c of [digest_from, digest_end). checksum is 1 while it
+    // grows with every fill or flush, -1 once a gap stopped it.
+    int32_t checksum;
+    uint32_t crc;
+    size_t digest_from;
+    size_t digest_end;
+    // buffer sizing, from hints and the access pattern
+    fs_advice advice;
+    fs_advice os_advice;
+    size_t buffer_limit;
+    uint32_t sequential;
+    uint32_t random;
+    // what the byte order mark of a text stream told us.
+    // encoding is 0 when there was none.
+    file_stream_type encoding;
+    int32_t big_endian;
+    uint32_t bom_size;
+    // the unit size we byte swap on every fill, 0 for none
+    uint32_t swap_units;
+#if defined(CSTREAM_STATS)
+    fs_stats stats;
+#endif
 
 } file_stream;
 
@@ -141,514 +258,5770 @@ typedef struct bit_stream_t
     {
         file_stream animal;
     } base;
+    // bits go most significant first into 64 bit words.
+    // mask marks the next bit, a reader with a zero mask is empty.
     uint64_t mask;
     uint64_t part;
+    // the word after part, when a reader peeked into it
+    uint64_t ahead;
+    uint32_t has_ahead;
 } bit_stream;
 
-#define declare_delim(name, char_size, delim_cb)                               \
-    size_t static name(file_stream *fs, uint8_t **line_start,                  \
-                       int32_t delim_val)                                      \
+#define declare_scan(name, char_size, delim_cb)                                \
+    static size_t name(const uint8_t *p, size_t n, int32_t delim_val,          \
+                       int32_t eq)                                             \
     {                                                                          \
-        size_t line_len = 0;                                                   \
-    n_entry:                                                                   \
-        for (size_t i = (fs->buffer_ptr + fs->buffer_size) - fs->file_ptr;     \
-             i < fs->buffer_size; i += char_size) {                            \
-            *line_start = &fs->buffer[i];                                      \
-            if (delim_cb(&fs->buffer[i]) == delim_val) {                       \
-                goto c_entry;                                                  \
-            }                                                                  \
-            fs->buffer_ptr += char_size;                                       \
-        }                                                                      \
-        if ((char_size + fs->buffer_ptr) > fs->file_ptr) {                     \
-            if (sync_stream_read(fs, char_size) == 0) {                        \
-                return 0;                                                      \
-            }                                                                  \
-        }                                                                      \
-        goto n_entry;                                                          \
-    c_entry:                                                                   \
-        for (size_t i = (fs->buffer_ptr + fs->buffer_size) - fs->file_ptr;     \
-             i < fs->buffer_size; i += char_size) {                            \
-            if (delim_cb(&fs->buffer[i]) != delim_val) {                       \
-                return line_len;                                               \
+        size_t i = 0;                                                          \
+        for (; i < n; i += char_size) {                                        \
+            if ((delim_cb((uint8_t *)&p[i]) == delim_val) == (eq != 0)) {      \
+                break;                                                         \
             }                                                                  \
-            fs->buffer_ptr += char_size;                                       \
-            line_len++;                                                        \
         }                                                                      \
-        if ((char_size + fs->buffer_ptr) > fs->file_ptr) {                     \
-            if (sync_stream_read(fs, char_size) == 0) {                        \
-                return line_len;                                               \
+        return i;                                                              \
+    }
+
+/*
+    Scan kernels find the first code unit in p[0, n) that is (eq)
+    or is not (!eq) a delimiter. They return the byte offset of that
+    unit, or n. The vector kernels test 16 or 32 bytes at a time and
+    finish the tail with the scalar kernel.
+*/
+typedef size_t (*fs_scan_fn)(const uint8_t *p, size_t n, int32_t delim_val,
+                             int32_t eq);
+
+declare_scan(scan_eol_8_scalar, 1, is_eol_8);
+declare_scan(scan_eol_16_scalar, 2, is_eol_16);
+declare_scan(scan_eol_32_scalar, 4, is_eol_32);
+declare_scan(scan_char_8_scalar, 1, from_char_8);
+declare_scan(scan_char_16_scalar, 2, from_char_16);
+declare_scan(scan_char_32_scalar, 4, from_char_32);
+declare_scan(scan_ascii_8_scalar, 1, is_ascii_8);
+declare_scan(scan_ascii_16_scalar, 2, is_ascii_16);
+declare_scan(scan_ascii_32_scalar, 4, is_ascii_32);
+
+#define scan_eol_norm(n)                                                       \
+    if (delim_val != 0 && delim_val != 1) {                                    \
+        return eq ? n : 0;                                                     \
+    }                                                                          \
+    int32_t want = (delim_val == 1) == (eq != 0)
+
+#define scan_char_norm(n, max_val)                                             \
+    if ((uint32_t)delim_val > (uint32_t)(max_val)) {                           \
+        return eq ? n : 0;                                                     \
+    }                                                                          \
+    int32_t want = eq
+
+#define declare_simd_scan(name, isa, vec, width, load, movemask, set1,         \
+                          classify, norm, tail)                                \
+    static __attribute__((target(isa))) size_t name(                           \
+        const uint8_t *p, size_t n, int32_t delim_val, int32_t eq)             \
+    {                                                                          \
+        size_t i = 0;                                                          \
+        norm;                                                                  \
+        vec d = set1(delim_val);                                               \
+        uint32_t flip = want ? 0 : (uint32_t)((1ull << width) - 1);            \
+        for (; (i + width) <= n; i += width) {                                 \
+            vec v = load((const vec *)&p[i]);                                  \
+            uint32_t m = (uint32_t)movemask(classify(v, d)) ^ flip;            \
+            if (m) {                                                           \
+                return i + __builtin_ctz(m);                                   \
             }                                                                  \
         }                                                                      \
-        goto c_entry;                                                          \
+        return i + tail(&p[i], n - i, delim_val, eq);                          \
     }
 
-void fs_flush(file_stream *fs)
+/*
+    Swap kernels reverse the bytes of every whole unit in p[0, n).
+*/
+typedef void (*fs_swap_fn)(uint8_t *p, size_t n);
+
+static void swap_units_16_scalar(uint8_t *p, size_t n)
 {
-    if (fs->mode & READ) {
-        return;
+    for (size_t i = 0; (i + 2) <= n; i += 2) {
+        *(uint16_t *)&p[i] = swap_16(&p[i]);
     }
+}
 
-    ssize_t opres = 0;
-    if ((opres = write(fs->fd, fs->buffer, fs->buffer_ptr - fs->file_ptr)) ==
-        -1) {
-        return;
+static void swap_units_32_scalar(uint8_t *p, size_t n)
+{
+    for (size_t i = 0; (i + 4) <= n; i += 4) {
+        *(uint32_t *)&p[i] = swap_32(&p[i]);
     }
-    fs->file_ptr += opres;
 }
 
-int64_t fs_seek(file_stream *fs, int32_t offset, int32_t whence)
+/*
+    Nth kernels count the bytes equal to c in p[0, n), until they see
+    the k-th one. They return the offset just past it and set *k to 0,
+    or return n with *k lowered by the count they saw.
+*/
+typedef size_t (*fs_nth_fn)(const uint8_t *p, size_t n, int32_t c, size_t *k);
+
+static size_t scan_nth_8_scalar(const uint8_t *p, size_t n, int32_t c,
+                                size_t *k)
 {
-    fs_flush(fs);
-    ssize_t opres = 0;
-    if ((opres = lseek(fs->fd, offset, whence)) == -1) {
-        // seek failed
-        return -1;
-    }
-    // if we jumped back to the beginning
-    if (opres == 0) {
-        // just reset and return
-        fs->file_ptr = 0;
-        fs->buffer_ptr = 0;
+    if (*k == 0) {
         return 0;
     }
-    size_t idx_offset = 0;
-    if (!(fs->mode & WRITE)) {
-        // if we jumped to the end
-        if (opres == (ssize_t)fs->file_size) {
-            // we have a fixed size if we are reading.
-            fs->file_ptr = opres;
-            fs->buffer_ptr = opres;
-            return opres;
+    for (size_t i = 0; i < n; i++) {
+        if (p[i] == (uint8_t)c && --(*k) == 0) {
+            return i + 1;
         }
-        offset = fs->buffer_size;
     }
-    ssize_t next_buffer_pos = (opres + idx_offset) - fs->file_ptr;
+    return n;
+}
 
-    fs->buffer_ptr = opres;
-    if (next_buffer_pos >= 0 && next_buffer_pos < (ssize_t)fs->buffer_size) {
-        // we have moved but are still within our current buffer.
-        return opres;
-    }
-    if ((opres % page_size) == 0) {
-        fs->file_ptr = opres;
-        return opres;
+#define declare_simd_nth(name, isa, vec, width, load, movemask, cmpeq, set1)  \
+    static __attribute__((target(isa))) size_t name(const uint8_t *p,          \
+                                                    size_t n, int32_t c,       \
+                                                    size_t *k)                 \
+    {                                                                          \
+        size_t i = 0;                                                          \
+        vec d = set1(c);                                                       \
+        if (*k == 0) {                                                         \
+            return 0;                                                          \
+        }                                                                      \
+        for (; (i + width) <= n; i += width) {                                 \
+            vec v = load((const vec *)&p[i]);                                  \
+            uint32_t m = (uint32_t)movemask(cmpeq(v, d));                      \
+            size_t found = __builtin_popcount(m);                              \
+            if (found < *k) {                                                  \
+                *k -= found;                                                   \
+                continue;                                                      \
+            }                                                                  \
+            for (size_t j = 1; j < *k; j++) {                                  \
+                m &= m - 1;                                                    \
+            }                                                                  \
+            *k = 0;                                                            \
+            return i + __builtin_ctz(m) + 1;                                   \
+        }                                                                      \
+        return i + scan_nth_8_scalar(&p[i], n - i, c, k);                      \
     }
 
-    //
-    size_t head = prev_page_multiple(opres);
-    if ((opres = lseek(fs->fd, head, SEEK_SET)) == -1) {
-        return -1;
-    }
-    fs->file_ptr = opres;
-    if ((opres = read(fs->fd, fs->buffer, fs->buffer_size)) == -1) {
-        return -1;
+#define declare_simd_swap(name, isa, vec, width, load, store, swap, tail)      \
+    static __attribute__((target(isa))) void name(uint8_t *p, size_t n)       \
+    {                                                                          \
+        size_t i = 0;                                                          \
+        for (; (i + width) <= n; i += width) {                                 \
+            store((vec *)&p[i], swap(load((const vec *)&p[i])));               \
+        }                                                                      \
+        tail(&p[i], n - i);                                                    \
     }
-    fs->buffer_size = opres;
-    if (fs->mode & READ) {
-        // move the file head
-        if ((opres = lseek(fs->fd, fs->buffer_size, SEEK_CUR)) == -1) {
-            return -1;
-        }
-        fs->file_ptr = opres;
+
+/*
+    Classify kernels compare the 64 bytes at p with each of the three
+    bytes in set, and give one bitmap per byte, bit i for p[i].
+*/
+typedef void (*fs_class_fn)(const uint8_t *p, const uint8_t *set,
+                            uint64_t *masks);
+
+static void classify_64_scalar(const uint8_t *p, const uint8_t *set,
+                               uint64_t *masks)
+{
+    uint64_t m0 = 0, m1 = 0, m2 = 0;
+    for (uint32_t i = 0; i < 64; i++) {
+        m0 |= (uint64_t)(p[i] == set[0]) << i;
+        m1 |= (uint64_t)(p[i] == set[1]) << i;
+        m2 |= (uint64_t)(p[i] == set[2]) << i;
     }
-    return fs->buffer_ptr;
+    masks[0] = m0;
+    masks[1] = m1;
+    masks[2] = m2;
 }
 
-typedef struct file_mode_configure_t
-{
-    uint32_t flags;
-    uint32_t mode;
-} file_mode_configure;
+#define declare_simd_classify(name, isa, vec, width, load, movemask, cmpeq,    \
+                              set1)                                            \
+    static __attribute__((target(isa))) void name(                             \
+        const uint8_t *p, const uint8_t *set, uint64_t *masks)                 \
+    {                                                                          \
+        vec v[64 / width];                                                     \
+        for (uint32_t i = 0; i < (64 / width); i++) {                          \
+            v[i] = load((const vec *)&p[i * width]);                           \
+        }                                                                      \
+        for (uint32_t k = 0; k < 3; k++) {                                     \
+            vec d = set1(set[k]);                                              \
+            uint64_t m = 0;                                                    \
+            for (uint32_t i = 0; i < (64 / width); i++) {                      \
+                m |= (uint64_t)(uint32_t)movemask(cmpeq(v[i], d))              \
+                     << (i * width);                                           \
+            }                                                                  \
+            masks[k] = m;                                                      \
+        }                                                                      \
+    }
 
-static int32_t mode_to_mask(char *m, file_mode_configure *conf)
+/*
+    Crc kernels fold p[0, n) into a running crc32c, the castagnoli
+    polynomial the SSE4.2 crc32 instruction computes. The running
+    value is kept inverted, it starts at ~0 and is inverted at the end.
+    The scalar kernel works 8 bytes at a time through 8 tables.
+*/
+typedef uint32_t (*fs_crc_fn)(uint32_t crc, const uint8_t *p, size_t n);
+
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_table_init()
 {
-    /*
-            read write create truncate append   pos
-        r     1    0     0       0       0     start
-        w     0    1     1       1       0     start
-        a     0    1     1       0       1     end
-        r+    1    1     0       0       0     start
-        w+    1    1     1       1       0     start
-        a+    1    1     1       0       1     start
-    */
-#if defined(LINUX)
-    conf->flags = O_DIRECT;
-#endif
-    conf->flags = 0; //|= O_SYNC;
-    conf->mode = 0;
-    switch (m[0]) {
-    case 'r':
-        if (m[1] == '+') {
-            conf->flags |= O_RDWR;
-            conf->mode |= S_IREAD | S_IWRITE;
-            return READ | WRITE;
-        } else if (m[1] == '\0') {
-            conf->flags |= O_RDONLY;
-            conf->mode |= S_IREAD;
-            return READ;
-        } else {
-            break;
-        }
-    case 'w':
-        if (m[1] == '+') {
-            conf->flags |= O_RDWR | O_CREAT | O_TRUNC;
-            conf->mode |= S_IREAD | S_IWRITE;
-            return READ | WRITE | CREATE | TRUNCATE;
-        } else if (m[1] == '\0') {
-            conf->flags |= O_RDWR | O_CREAT | O_TRUNC;
-            conf->mode |= S_IWRITE;
-            return WRITE | CREATE | TRUNCATE;
-        } else {
-            break;
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (uint32_t k = 0; k < 8; k++) {
+            c = (c >> 1) ^ (0x82F63B78 & (0 - (c & 1)));
         }
-    case 'a':
-        if (m[1] == '+') {
-            conf->flags |= O_RDWR | O_CREAT;
-            conf->mode |= S_IREAD | S_IWRITE;
-            return READ | WRITE | CREATE | APPEND;
-        } else if (m[1] == '\0') {
-            conf->flags |= O_WRONLY | O_CREAT;
-            conf->mode |= S_IWRITE;
-            return WRITE | CREATE | APPEND;
-        } else {
-            break;
+        crc32c_table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (uint32_t t = 1; t < 8; t++) {
+            uint32_t c = crc32c_table[t - 1][i];
+            crc32c_table[t][i] = (c >> 8) ^ crc32c_table[0][c & 0xFF];
         }
-    default:
-        break;
     }
-    return INVALID;
 }
-static file_stream *create_stream(uint8_t stream_size, const char *p,
-                                  char *mode)
-{
-    //
-    // the internal mode flag
-    //
 
-    /*
-        we use the buffer-less file IO. Because we are managing our own buffer.
-    */
-    file_mode_configure config;
-    file_stream_mode emode = mode_to_mask(mode, &config);
-    if (emode == INVALID) {
-        return NULL;
-    }
-    int32_t fd = open(p, config.flags, config.mode);
-    if (fd == -1) {
-        // Well that did not work out so well.
-        return NULL;
+static uint32_t crc32c_scalar(uint32_t crc, const uint8_t *p, size_t n)
+{
+    size_t i = 0;
+    for (; (i + 8) <= n; i += 8) {
+        uint64_t v;
+        memcpy(&v, &p[i], 8);
+        v ^= crc;
+        crc = crc32c_table[7][v & 0xFF] ^ crc32c_table[6][(v >> 8) & 0xFF] ^
+              crc32c_table[5][(v >> 16) & 0xFF] ^
+              crc32c_table[4][(v >> 24) & 0xFF] ^
+              crc32c_table[3][(v >> 32) & 0xFF] ^
+              crc32c_table[2][(v >> 40) & 0xFF] ^
+              crc32c_table[1][(v >> 48) & 0xFF] ^ crc32c_table[0][v >> 56];
     }
-
-    // create our stream
-    file_stream *new_stream = (file_stream *)malloc(stream_size);
-    new_stream->fd = fd;
-    new_stream->mode = emode;
-    new_stream->buffer_size = alloc_size;
-    new_stream->file_size = page_size;
-    new_stream->buffer = (uint8_t *)malloc(new_stream->buffer_size);
-    new_stream->buffer_ptr = 0;
-    new_stream->file_ptr = 0;
-
-    struct stat stats;
-    if (fstat(fd, &stats) == 0) {
-        new_stream->file_size = stats.st_size;
-        if ((new_stream->file_size > 0) &&
-            (new_stream->file_size < new_stream->buffer_size)) {
-            new_stream->buffer_size = new_stream->file_size;
-        }
+    for (; i < n; i++) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ p[i]) & 0xFF];
     }
+    return crc;
+}
 
-    return new_stream;
+#if defined(CSTREAM_X86)
+/*
+    SSE2 classifiers. The eol sets are {0, 5, 0xA..0xD} plus the
+    modified utf8 pairs, on native endian units. SSE2 has no byte
+    shuffle, so its swaps are shifts.
+*/
+#define SSE2_ATTR __attribute__((target("sse2")))
+static inline SSE2_ATTR __m128i swap_16_sse2(__m128i v)
+{
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
 }
 
-file_stream *fs_open(const char *p, char *mode)
+static inline SSE2_ATTR __m128i swap_32_sse2(__m128i v)
 {
-    /*
-        Create a file streaming object
-    */
-    return create_stream(sizeof(file_stream), p, mode);
+    v = swap_16_sse2(v);
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    return _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
 }
 
-void close_stream(file_stream *stream)
+static inline SSE2_ATTR __m128i eol_8_sse2(__m128i v, __m128i d)
 {
-    // release our buffer and file descriptor
-    if (stream) {
-        fs_flush(stream);
-        close(stream->fd);
-        // release our heap stores
-        free(stream->buffer);
-        free(stream);
-    }
+    __m128i r = _mm_sub_epi8(v, _mm_set1_epi8(0x0A));
+    __m128i m = _mm_cmpeq_epi8(_mm_min_epu8(r, _mm_set1_epi8(3)), r);
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+    return _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(0x05)));
 }
 
-static size_t resize_buffer(file_stream *fs, size_t sm)
+static inline SSE2_ATTR __m128i small_eol_16_sse2(__m128i v)
 {
-    /*
-        we compute the span of the buffers range in
-        os page sizes.
+    __m128i r = _mm_sub_epi16(v, _mm_set1_epi16(0x0A));
+    __m128i m = _mm_cmpeq_epi16(_mm_subs_epu16(r, _mm_set1_epi16(3)),
+                                _mm_setzero_si128());
+    m = _mm_or_si128(m, _mm_cmpeq_epi16(v, _mm_setzero_si128()));
+    return _mm_or_si128(m, _mm_cmpeq_epi16(v, _mm_set1_epi16(0x05)));
+}
 
-        When a size request reaches passed the current end of
-        the buffer, we need to see if the size requested and
-        the current page we are in will fit into our current buffer.
+static inline SSE2_ATTR __m128i eol_16_sse2(__m128i v, __m128i d)
+{
+    __m128i m = small_eol_16_sse2(v);
+    m = _mm_or_si128(m, _mm_cmpeq_epi16(v, _mm_set1_epi16((short)0xC080)));
+    return _mm_or_si128(m, _mm_cmpeq_epi16(v, _mm_set1_epi16((short)0x80C0)));
+}
 
-        Because to avoid needless copies, we just re-read
-        the current page, but set the start of our buffer
-        as that last page. Then we read in the remaining request,
-        rounded up to the next os page size.
+static inline SSE2_ATTR __m128i small_eol_32_sse2(__m128i v)
+{
+    __m128i sign = _mm_set1_epi32((int)0x80000000);
+    __m128i r = _mm_xor_si128(_mm_sub_epi32(v, _mm_set1_epi32(0x0A)), sign);
+    __m128i m = _mm_cmpgt_epi32(_mm_set1_epi32((int)0x80000004), r);
+    m = _mm_or_si128(m, _mm_cmpeq_epi32(v, _mm_setzero_si128()));
+    return _mm_or_si128(m, _mm_cmpeq_epi32(v, _mm_set1_epi32(0x05)));
+}
 
-    */
-    size_t head = prev_page_multiple(fs->buffer_ptr);
-    size_t tail = next_page_multiple(sm + fs->buffer_ptr);
-    size_t span = tail - head;
-    size_t start_offset = fs->buffer_ptr - head;
-    fs->buffer_ptr = head;
+static inline SSE2_ATTR __m128i eol_32_sse2(__m128i v, __m128i d)
+{
+    __m128i m = small_eol_32_sse2(v);
+    m = _mm_or_si128(m, _mm_cmpeq_epi32(v, _mm_set1_epi32(0xC080)));
+    return _mm_or_si128(m, _mm_cmpeq_epi32(v, _mm_set1_epi32((int)0xC0800000)));
+}
 
-    // if we need more space for our buffer
-    if (span > fs->buffer_size) {
-        free(fs->buffer);
-        fs->buffer = (uint8_t *)malloc(span);
-        fs->buffer_size = span;
-    }
+static inline SSE2_ATTR __m128i ascii_8_sse2(__m128i v, __m128i d)
+{
+    return _mm_cmpgt_epi8(v, _mm_set1_epi8(-1));
+}
 
-    // do we need to rewind, because we are streaming
-    // passed the end.
-    if (start_offset > 0) {
-        // rewind to our last page multiple
-        off_t o = lseek(fs->fd, -start_offset, SEEK_CUR);
-        fs->file_ptr -= start_offset;
-    }
-    return start_offset;
+static inline SSE2_ATTR __m128i ascii_16_sse2(__m128i v, __m128i d)
+{
+    v = _mm_and_si128(v, _mm_set1_epi16((short)0xFF80));
+    return _mm_cmpeq_epi16(v, _mm_setzero_si128());
 }
 
-static size_t sync_stream_read(file_stream *fs, size_t sm)
+static inline SSE2_ATTR __m128i ascii_32_sse2(__m128i v, __m128i d)
 {
-    /*
-        Sync the stream and the internal buffer.
-    */
+    v = _mm_and_si128(v, _mm_set1_epi32((int)0xFFFFFF80));
+    return _mm_cmpeq_epi32(v, _mm_setzero_si128());
+}
 
-    if (fs->file_ptr == fs->file_size) {
-        return 0;
-    }
-    size_t next_size = fs->buffer_size;
-    ssize_t opres = 0;
+static inline SSE2_ATTR __m128i set1_8_sse2(int32_t c)
+{
+    return _mm_set1_epi8((char)c);
+}
+static inline SSE2_ATTR __m128i set1_16_sse2(int32_t c)
+{
+    return _mm_set1_epi16((short)c);
+}
+static inline SSE2_ATTR __m128i set1_32_sse2(int32_t c)
+{
+    return _mm_set1_epi32(c);
+}
 
-    if ((fs->buffer_ptr % fs->buffer_size) == 0) {
-        /*
-            The fast path when you are streaming fixed sizes
-        */
-        if (sm > fs->buffer_size) {
-            /*
-                A rare case where you are at the very border
-                but the size is larger then the buffer.
-            */
-            resize_buffer(fs, sm);
-        }
-    } else {
-        /*
-            We still have data left in our current buffer.
-            And want to stream the next part.
-        */
-        resize_buffer(fs, sm);
-    }
-    if ((fs->file_ptr + next_size) > fs->file_size) {
-        next_size = fs->file_size - fs->file_ptr;
-        fs->buffer_size = next_size;
-    }
-    // stream the next batch
-    if ((opres = read(fs->fd, fs->buffer, next_size)) == -1) {
-        return 0;
-    }
+declare_simd_scan(scan_eol_8_sse2, "sse2", __m128i, 16, _mm_loadu_si128,
+                  _mm_movemask_epi8, set1_8_sse2, eol_8_sse2,
+                  scan_eol_norm(n), scan_eol_8_scalar);
+declare_simd_scan(scan_eol_16_sse2, "sse2", __m128i, 16, _mm_loadu_si128,
+                  _mm_movemask_epi8, set1_16_sse2, eol_16_sse2,
+                  scan_eol_norm(n), scan_eol_16_scalar);
+declare_simd_scan(scan_eol_32_sse2, "sse2", __m128i, 16, _mm_loadu_si128,
+                  _mm_movemask_epi8, set1_32_sse2, eol_32_sse2,
+                  scan_eol_norm(n), scan_eol_32_scalar);
+declare_simd_scan(scan_char_8_sse2, "sse2", __m128i, 16, _mm_loadu_si128,
+                  _mm_movemask_epi8, set1_8_sse2, _mm_cmpeq_epi8,
+                  scan_char_norm(n, 0xFF), scan_char_8_scalar);
+declare_simd_scan(scan_char_16_sse2, "sse2", __m128i, 16, _mm_loadu_si128,
+                  _mm_movemask_epi8, set1_16_sse2, _mm_cmpeq_epi16,
+                  scan_char_norm(n, 0xFFFF), scan_char_16_scalar);
+declare_simd_scan(scan_char_32_sse2, "sse2", __m128i, 16, _mm_loadu_si128,
+                  _mm_movemask_epi8, set1_32_sse2, _mm_cmpeq_epi32,
+                  scan_char_norm(n, 0xFFFFFFFF), scan_char_32_scalar);
+declare_simd_scan(scan_ascii_8_sse2, "sse2", __m128i, 16, _mm_loadu_si128,
+                  _mm_movemask_epi8, set1_8_sse2, ascii_8_sse2,
+                  scan_eol_norm(n), scan_ascii_8_scalar);
+declare_simd_scan(scan_ascii_16_sse2, "sse2", __m128i, 16, _mm_loadu_si128,
+                  _mm_movemask_epi8, set1_16_sse2, ascii_16_sse2,
+                  scan_eol_norm(n), scan_ascii_16_scalar);
+declare_simd_scan(scan_ascii_32_sse2, "sse2", __m128i, 16, _mm_loadu_si128,
+                  _mm_movemask_epi8, set1_32_sse2, ascii_32_sse2,
+                  scan_eol_norm(n), scan_ascii_32_scalar);
+declare_simd_nth(scan_nth_8_sse2, "sse2", __m128i, 16, _mm_loadu_si128,
+                 _mm_movemask_epi8, _mm_cmpeq_epi8, set1_8_sse2);
+declare_simd_swap(swap_units_16_sse2, "sse2", __m128i, 16, _mm_loadu_si128,
+                  _mm_storeu_si128, swap_16_sse2, swap_units_16_scalar);
+declare_simd_swap(swap_units_32_sse2, "sse2", __m128i, 16, _mm_loadu_si128,
+                  _mm_storeu_si128, swap_32_sse2, swap_units_32_scalar);
+declare_simd_classify(classify_64_sse2, "sse2", __m128i, 16, _mm_loadu_si128,
+                      _mm_movemask_epi8, _mm_cmpeq_epi8, set1_8_sse2);
 
-    fs->file_ptr += opres;
+/*
+    AVX2 classifiers, the same tests on 32 byte vectors.
+    Swaps are a single byte shuffle within each 16 byte lane.
+*/
+#define AVX2_ATTR __attribute__((target("avx2")))
+static inline AVX2_ATTR __m256i swap_16_avx2(__m256i v)
+{
+    const __m256i order =
+        _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                         1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    return _mm256_shuffle_epi8(v, order);
+}
 
-    return opres;
+static inline AVX2_ATTR __m256i swap_32_avx2(__m256i v)
+{
+    const __m256i order =
+        _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                         3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    return _mm256_shuffle_epi8(v, order);
 }
 
-static size_t sync_stream_write(file_stream *fs, size_t sm)
+static inline AVX2_ATTR __m256i eol_8_avx2(__m256i v, __m256i d)
+{
+    __m256i r = _mm256_sub_epi8(v, _mm256_set1_epi8(0x0A));
+    __m256i m = _mm256_cmpeq_epi8(_mm256_min_epu8(r, _mm256_set1_epi8(3)), r);
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+    return _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x05)));
+}
+
+static inline AVX2_ATTR __m256i small_eol_16_avx2(__m256i v)
+{
+    __m256i r = _mm256_sub_epi16(v, _mm256_set1_epi16(0x0A));
+    __m256i m = _mm256_cmpeq_epi16(_mm256_subs_epu16(r, _mm256_set1_epi16(3)),
+                                   _mm256_setzero_si256());
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi16(v, _mm256_setzero_si256()));
+    return _mm256_or_si256(m, _mm256_cmpeq_epi16(v, _mm256_set1_epi16(0x05)));
+}
+
+static inline AVX2_ATTR __m256i eol_16_avx2(__m256i v, __m256i d)
+{
+    __m256i m = small_eol_16_avx2(v);
+    m = _mm256_or_si256(
+        m, _mm256_cmpeq_epi16(v, _mm256_set1_epi16((short)0xC080)));
+    return _mm256_or_si256(
+        m, _mm256_cmpeq_epi16(v, _mm256_set1_epi16((short)0x80C0)));
+}
+
+static inline AVX2_ATTR __m256i small_eol_32_avx2(__m256i v)
+{
+    __m256i sign = _mm256_set1_epi32((int)0x80000000);
+    __m256i r =
+        _mm256_xor_si256(_mm256_sub_epi32(v, _mm256_set1_epi32(0x0A)), sign);
+    __m256i m = _mm256_cmpgt_epi32(_mm256_set1_epi32((int)0x80000004), r);
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi32(v, _mm256_setzero_si256()));
+    return _mm256_or_si256(m, _mm256_cmpeq_epi32(v, _mm256_set1_epi32(0x05)));
+}
+
+static inline AVX2_ATTR __m256i eol_32_avx2(__m256i v, __m256i d)
+{
+    __m256i m = small_eol_32_avx2(v);
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi32(v, _mm256_set1_epi32(0xC080)));
+    return _mm256_or_si256(
+        m, _mm256_cmpeq_epi32(v, _mm256_set1_epi32((int)0xC0800000)));
+}
+
+static inline AVX2_ATTR __m256i ascii_8_avx2(__m256i v, __m256i d)
+{
+    return _mm256_cmpgt_epi8(v, _mm256_set1_epi8(-1));
+}
+
+static inline AVX2_ATTR __m256i ascii_16_avx2(__m256i v, __m256i d)
+{
+    v = _mm256_and_si256(v, _mm256_set1_epi16((short)0xFF80));
+    return _mm256_cmpeq_epi16(v, _mm256_setzero_si256());
+}
+
+static inline AVX2_ATTR __m256i ascii_32_avx2(__m256i v, __m256i d)
+{
+    v = _mm256_and_si256(v, _mm256_set1_epi32((int)0xFFFFFF80));
+    return _mm256_cmpeq_epi32(v, _mm256_setzero_si256());
+}
+
+static inline AVX2_ATTR __m256i set1_8_avx2(int32_t c)
+{
+    return _mm256_set1_epi8((char)c);
+}
+static inline AVX2_ATTR __m256i set1_16_avx2(int32_t c)
+{
+    return _mm256_set1_epi16((short)c);
+}
+static inline AVX2_ATTR __m256i set1_32_avx2(int32_t c)
+{
+    return _mm256_set1_epi32(c);
+}
+
+declare_simd_scan(scan_eol_8_avx2, "avx2", __m256i, 32, _mm256_loadu_si256,
+                  _mm256_movemask_epi8, set1_8_avx2, eol_8_avx2,
+                  scan_eol_norm(n), scan_eol_8_scalar);
+declare_simd_scan(scan_eol_16_avx2, "avx2", __m256i, 32, _mm256_loadu_si256,
+                  _mm256_movemask_epi8, set1_16_avx2, eol_16_avx2,
+                  scan_eol_norm(n), scan_eol_16_scalar);
+declare_simd_scan(scan_eol_32_avx2, "avx2", __m256i, 32, _mm256_loadu_si256,
+                  _mm256_movemask_epi8, set1_32_avx2, eol_32_avx2,
+                  scan_eol_norm(n), scan_eol_32_scalar);
+declare_simd_scan(scan_char_8_avx2, "avx2", __m256i, 32, _mm256_loadu_si256,
+                  _mm256_movemask_epi8, set1_8_avx2, _mm256_cmpeq_epi8,
+                  scan_char_norm(n, 0xFF), scan_char_8_scalar);
+declare_simd_scan(scan_char_16_avx2, "avx2", __m256i, 32, _mm256_loadu_si256,
+                  _mm256_movemask_epi8, set1_16_avx2, _mm256_cmpeq_epi16,
+                  scan_char_norm(n, 0xFFFF), scan_char_16_scalar);
+declare_simd_scan(scan_char_32_avx2, "avx2", __m256i, 32, _mm256_loadu_si256,
+                  _mm256_movemask_epi8, set1_32_avx2, _mm256_cmpeq_epi32,
+                  scan_char_norm(n, 0xFFFFFFFF), scan_char_32_scalar);
+declare_simd_scan(scan_ascii_8_avx2, "avx2", __m256i, 32, _mm256_loadu_si256,
+                  _mm256_movemask_epi8, set1_8_avx2, ascii_8_avx2,
+                  scan_eol_norm(n), scan_ascii_8_scalar);
+declare_simd_scan(scan_ascii_16_avx2, "avx2", __m256i, 32, _mm256_loadu_si256,
+                  _mm256_movemask_epi8, set1_16_avx2, ascii_16_avx2,
+                  scan_eol_norm(n), scan_ascii_16_scalar);
+declare_simd_scan(scan_ascii_32_avx2, "avx2", __m256i, 32, _mm256_loadu_si256,
+                  _mm256_movemask_epi8, set1_32_avx2, ascii_32_avx2,
+                  scan_eol_norm(n), scan_ascii_32_scalar);
+declare_simd_nth(scan_nth_8_avx2, "avx2,popcnt", __m256i, 32,
+                 _mm256_loadu_si256, _mm256_movemask_epi8, _mm256_cmpeq_epi8,
+                 set1_8_avx2);
+declare_simd_swap(swap_units_16_avx2, "avx2", __m256i, 32, _mm256_loadu_si256,
+                  _mm256_storeu_si256, swap_16_avx2, swap_units_16_scalar);
+declare_simd_swap(swap_units_32_avx2, "avx2", __m256i, 32, _mm256_loadu_si256,
+                  _mm256_storeu_si256, swap_32_avx2, swap_units_32_scalar);
+declare_simd_classify(classify_64_avx2, "avx2", __m256i, 32,
+                      _mm256_loadu_si256, _mm256_movemask_epi8,
+                      _mm256_cmpeq_epi8, set1_8_avx2);
+
+/*
+    Every AVX2 cpu has the SSE4.2 crc32 instruction,
+    so the AVX2 table checksums with it.
+*/
+#if defined(__x86_64__)
+static __attribute__((target("sse4.2"))) uint32_t
+crc32c_sse42(uint32_t crc, const uint8_t *p, size_t n)
+{
+    size_t i = 0;
+    uint64_t c = crc;
+    for (; (i + 8) <= n; i += 8) {
+        uint64_t v;
+        memcpy(&v, &p[i], 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    for (; i < n; i++) {
+        c = _mm_crc32_u8((uint32_t)c, p[i]);
+    }
+    return (uint32_t)c;
+}
+#else
+#define crc32c_sse42 crc32c_scalar
+#endif
+#endif
+
+typedef enum fs_scan_isa_e {
+    SCAN_SCALAR = 0,
+    SCAN_SSE2 = 1,
+    SCAN_AVX2 = 2
+} fs_scan_isa;
+
+typedef struct fs_scan_table_t
+{
+    fs_scan_isa isa;
+    int32_t selected;
+    fs_scan_fn eol_8;
+    fs_scan_fn eol_16;
+    fs_scan_fn eol_32;
+    fs_scan_fn char_8;
+    fs_scan_fn char_16;
+    fs_scan_fn char_32;
+    fs_scan_fn ascii_8;
+    fs_scan_fn ascii_16;
+    fs_scan_fn ascii_32;
+    fs_nth_fn nth_8;
+    fs_swap_fn swap_16;
+    fs_swap_fn swap_32;
+    fs_class_fn class_64;
+    fs_crc_fn crc_32c;
+} fs_scan_table;
+
+static fs_scan_table scan_table = {
+    SCAN_SCALAR,          0,
+    scan_eol_8_scalar,    scan_eol_16_scalar,   scan_eol_32_scalar,
+    scan_char_8_scalar,   scan_char_16_scalar,  scan_char_32_scalar,
+    scan_ascii_8_scalar,  scan_ascii_16_scalar, scan_ascii_32_scalar,
+    scan_nth_8_scalar,    swap_units_16_scalar, swap_units_32_scalar,
+    classify_64_scalar,   crc32c_scalar};
+
+static fs_scan_isa fs_best_scan_isa()
+{
+#if defined(CSTREAM_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return SCAN_AVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return SCAN_SSE2;
+    }
+#endif
+    return SCAN_SCALAR;
+}
+
+fs_scan_isa fs_set_scan_isa(fs_scan_isa isa)
+{
+    /*
+        Pick the scan kernels used by fs_read_line and fs_get_delim,
+        the byte swaps and ascii runs of text streams, the
+        classifier of csv streams and the stream checksums.
+        Requests above what the cpu supports are clamped.
+    */
+    fs_scan_isa best = fs_best_scan_isa();
+    if (isa > best) {
+        isa = best;
+    }
+    fs_scan_table t = {SCAN_SCALAR,          1,
+                       scan_eol_8_scalar,    scan_eol_16_scalar,
+                       scan_eol_32_scalar,   scan_char_8_scalar,
+                       scan_char_16_scalar,  scan_char_32_scalar,
+                       scan_ascii_8_scalar,  scan_ascii_16_scalar,
+                       scan_ascii_32_scalar, scan_nth_8_scalar,
+                       swap_units_16_scalar, swap_units_32_scalar,
+                       classify_64_scalar,   crc32c_scalar};
+#if defined(CSTREAM_X86)
+    if (isa == SCAN_AVX2) {
+        fs_scan_table avx2 = {SCAN_AVX2,          1,
+                              scan_eol_8_avx2,    scan_eol_16_avx2,
+                              scan_eol_32_avx2,   scan_char_8_avx2,
+                              scan_char_16_avx2,  scan_char_32_avx2,
+                              scan_ascii_8_avx2,  scan_ascii_16_avx2,
+                              scan_ascii_32_avx2, scan_nth_8_avx2,
+                              swap_units_16_avx2, swap_units_32_avx2,
+                              classify_64_avx2,   crc32c_sse42};
+        t = avx2;
+    } else if (isa == SCAN_SSE2) {
+        fs_scan_table sse2 = {SCAN_SSE2,          1,
+                              scan_eol_8_sse2,    scan_eol_16_sse2,
+                              scan_eol_32_sse2,   scan_char_8_sse2,
+                              scan_char_16_sse2,  scan_char_32_sse2,
+                              scan_ascii_8_sse2,  scan_ascii_16_sse2,
+                              scan_ascii_32_sse2, scan_nth_8_sse2,
+                              swap_units_16_sse2, swap_units_32_sse2,
+                              classify_64_sse2,   crc32c_scalar};
+        t = sse2;
+    }
+#endif
+    scan_table = t;
+    return isa;
+}
+
+static inline size_t scan_eol_8(const uint8_t *p, size_t n, int32_t d,
+                                int32_t eq)
+{
+    return scan_table.eol_8(p, n, d, eq);
+}
+static inline size_t scan_eol_16(const uint8_t *p, size_t n, int32_t d,
+                                 int32_t eq)
+{
+    return scan_table.eol_16(p, n, d, eq);
+}
+static inline size_t scan_eol_32(const uint8_t *p, size_t n, int32_t d,
+                                 int32_t eq)
+{
+    return scan_table.eol_32(p, n, d, eq);
+}
+static inline size_t scan_char_8(const uint8_t *p, size_t n, int32_t d,
+                                 int32_t eq)
+{
+    return scan_table.char_8(p, n, d, eq);
+}
+static inline size_t scan_char_16(const uint8_t *p, size_t n, int32_t d,
+                                  int32_t eq)
+{
+    return scan_table.char_16(p, n, d, eq);
+}
+static inline size_t scan_char_32(const uint8_t *p, size_t n, int32_t d,
+                                  int32_t eq)
+{
+    return scan_table.char_32(p, n, d, eq);
+}
+
+static void text_swap(file_stream *fs, uint8_t *p, size_t offset, ssize_t n)
+{
+    /*
+        Byte swap a fill of n bytes that was read at offset,
+        so the scanners only ever see native endian units.
+        Units are counted from the start of the file.
+    */
+    if (fs->swap_units == 0 || n <= 0) {
+        return;
+    }
+    size_t mask = fs->swap_units - 1;
+    size_t skip = (fs->swap_units - (offset & mask)) & mask;
+    if ((size_t)n <= skip) {
+        return;
+    }
+    if (fs->swap_units == 2) {
+        scan_table.swap_16(p + skip, n - skip);
+    } else {
+        scan_table.swap_32(p + skip, n - skip);
+    }
+}
+
+static void checksum_update(file_stream *fs, size_t offset, const uint8_t *p,
+                            size_t n)
+{
+    /*
+        Fold the bytes at [offset, offset + n) into the checksum,
+        past what it covers already. A gap in front of them stops it.
+    */
+    if (fs->checksum != 1 || (offset + n) <= fs->digest_end) {
+        return;
+    }
+    if (offset > fs->digest_end) {
+        fs->checksum = -1;
+        return;
+    }
+    size_t skip = fs->digest_end - offset;
+    fs->crc = scan_table.crc_32c(fs->crc, p + skip, n - skip);
+    fs->digest_end = offset + n;
+}
+
+static void checksum_fill(file_stream *fs, size_t offset, uint8_t *p,
+                          ssize_t n)
+{
+    // a fill that was swapped already counts as it is in the file
+    if (fs->checksum != 1 || n <= 0) {
+        return;
+    }
+    text_swap(fs, p, offset, n);
+    checksum_update(fs, offset, p, n);
+    text_swap(fs, p, offset, n);
+}
+
+static void checksum_seek(file_stream *fs, size_t target)
+{
+    // a writer going back over checksummed bytes voids the checksum
+    if (fs->checksum == 1 && target < fs->digest_end) {
+        fs->checksum = -1;
+        fs->crc = ~0u;
+        fs->digest_end = fs->digest_from;
+    }
+}
+
+#define declare_delim(name, char_size, scan_cb)                                \
+    size_t static name(file_stream *fs, uint8_t **line_start,                  \
+                       int32_t delim_val)                                      \
+    {                                                                          \
+        size_t line_len = 0;                                                   \
+        size_t idx = 0;                                                        \
+        size_t avail = 0;                                                      \
+        /* skip the delimiters in front of the line */                         \
+    n_entry:                                                                   \
+        idx = (fs->buffer_ptr + fs->buffer_size) - fs->file_ptr;               \
+        avail = fs->buffer_size - idx;                                         \
+        avail -= avail % char_size;                                            \
+        line_len = scan_cb(&fs->buffer[idx], avail, delim_val, 0);             \
+        fs->buffer_ptr += line_len;                                            \
+        if (line_len == avail) {                                               \
+            if (sync_stream_read(fs, char_size) == 0) {                        \
+                return 0;                                                      \
+            }                                                                  \
+            goto n_entry;                                                      \
+        }                                                                      \
+        /* find the end of the line, keeping it contiguous */                  \
+        line_len = 0;                                                          \
+    c_entry:                                                                   \
+        idx = (fs->buffer_ptr + fs->buffer_size) - fs->file_ptr;               \
+        avail = fs->buffer_size - idx;                                         \
+        avail -= avail % char_size;                                            \
+        line_len += scan_cb(&fs->buffer[idx + line_len], avail - line_len,     \
+                            delim_val, 1);                                     \
+        if (line_len == avail) {                                               \
+            if (sync_stream_read(fs, line_len + char_size) != 0) {             \
+                goto c_entry;                                                  \
+            }                                                                  \
+        }                                                                      \
+        *line_start = &fs->buffer[idx];                                        \
+        fs->buffer_ptr += line_len;                                            \
+        return line_len / char_size;                                           \
+    }
+
+/*
+    Buffer allocation.
+    Stream buffers go through a replaceable allocator. Every buffer is
+    released with the size it was allocated with. Buffers for direct io
+    have to start on a page.
+*/
+typedef struct fs_allocator_t
+{
+    void *(*alloc)(void *ctx, size_t size);
+    void (*release)(void *ctx, void *ptr, size_t size);
+    void *ctx;
+} fs_allocator;
+
+static void *page_alloc(void *ctx, size_t size)
+{
+    void *buffer = NULL;
+    if (posix_memalign(&buffer, page_size, MAX(size, 1)) != 0) {
+        return NULL;
+    }
+    return buffer;
+}
+
+static void page_release(void *ctx, void *ptr, size_t size) { free(ptr); }
+
+static fs_allocator buffer_allocator = {page_alloc, page_release, NULL};
+
+void fs_set_allocator(const fs_allocator *allocator)
+{
+    /*
+        Install an allocator for stream buffers, NULL restores the default.
+        Only swap allocators while no streams or readers are open.
+    */
+    fs_allocator page = {page_alloc, page_release, NULL};
+    buffer_allocator = allocator ? *allocator : page;
+}
+
+static uint8_t *alloc_buffer(size_t size)
+{
+    return (uint8_t *)buffer_allocator.alloc(buffer_allocator.ctx, size);
+}
+
+static void release_buffer(void *ptr, size_t size)
+{
+    if (ptr) {
+        buffer_allocator.release(buffer_allocator.ctx, ptr, size);
+    }
+}
+
+/*
+    The buffer pool.
+    Buffers are kept in power of two size classes from a page to 64 MB,
+    each class behind its own lock. Classes from the huge page size up
+    are mapped, and optionally backed by huge pages.
+*/
+#define POOL_CLASSES 15
+const static uint64_t pool_class_bytes = 1 << 25;
+
+typedef struct fs_pool_class_t
+{
+    pthread_mutex_t lock;
+    void *free;
+    size_t count;
+} fs_pool_class;
+
+typedef struct fs_pool_t
+{
+    pthread_once_t once;
+    int32_t huge_pages;
+    fs_pool_class classes[POOL_CLASSES];
+} fs_pool;
+
+static fs_pool buffer_pool = {PTHREAD_ONCE_INIT, 0};
+
+static void pool_init()
+{
+    for (uint32_t i = 0; i < POOL_CLASSES; i++) {
+        pthread_mutex_init(&buffer_pool.classes[i].lock, NULL);
+        buffer_pool.classes[i].free = NULL;
+        buffer_pool.classes[i].count = 0;
+    }
+}
+
+static uint32_t pool_class(size_t size)
+{
+    if (size <= page_size) {
+        return 0;
+    }
+    // log2 of the next power of two, counted from a page
+    return (64 - __builtin_clzll(size - 1)) - 12;
+}
+
+static void *pool_raw_alloc(fs_pool *pool, size_t size)
+{
+    if (size < huge_page_size) {
+        return page_alloc(NULL, size);
+    }
+    void *m = MAP_FAILED;
+#if defined(LINUX) && defined(MAP_HUGETLB)
+    if (pool->huge_pages && (size % huge_page_size) == 0) {
+        m = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (m == MAP_FAILED) {
+        m = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (m == MAP_FAILED) {
+            return NULL;
+        }
+#if defined(LINUX) && defined(MADV_HUGEPAGE)
+        if (pool->huge_pages) {
+            madvise(m, size, MADV_HUGEPAGE);
+        }
+#endif
+    }
+    return m;
+}
+
+static void pool_raw_release(void *ptr, size_t size)
+{
+    if (size < huge_page_size) {
+        free(ptr);
+    } else {
+        munmap(ptr, size);
+    }
+}
+
+static void *pool_alloc(void *ctx, size_t size)
+{
+    fs_pool *pool = (fs_pool *)ctx;
+    pthread_once(&pool->once, pool_init);
+    uint32_t idx = pool_class(size);
+    if (idx >= POOL_CLASSES) {
+        // too large to keep around
+        return pool_raw_alloc(pool, next_page_multiple(size));
+    }
+    fs_pool_class *c = &pool->classes[idx];
+    pthread_mutex_lock(&c->lock);
+    void *ptr = c->free;
+    if (ptr) {
+        c->free = *(void **)ptr;
+        c->count--;
+    }
+    pthread_mutex_unlock(&c->lock);
+    if (ptr == NULL) {
+        ptr = pool_raw_alloc(pool, page_size << idx);
+    }
+    return ptr;
+}
+
+static void pool_release(void *ctx, void *ptr, size_t size)
+{
+    fs_pool *pool = (fs_pool *)ctx;
+    uint32_t idx = pool_class(size);
+    if (idx >= POOL_CLASSES) {
+        pool_raw_release(ptr, next_page_multiple(size));
+        return;
+    }
+    size_t class_size = page_size << idx;
+    fs_pool_class *c = &pool->classes[idx];
+    pthread_mutex_lock(&c->lock);
+    // keep up to 32 MB, and at least two buffers, of every class
+    if ((c->count + 1) * class_size <= pool_class_bytes || c->count < 2) {
+        *(void **)ptr = c->free;
+        c->free = ptr;
+        c->count++;
+        ptr = NULL;
+    }
+    pthread_mutex_unlock(&c->lock);
+    if (ptr) {
+        pool_raw_release(ptr, class_size);
+    }
+}
+
+fs_allocator fs_pool_allocator(int32_t huge_pages)
+{
+    /*
+        The built-in pool, for fs_set_allocator.
+        With huge_pages set, buffers of 2 MB and up use huge pages.
+    */
+    pthread_once(&buffer_pool.once, pool_init);
+    buffer_pool.huge_pages = huge_pages;
+    fs_allocator pool = {pool_alloc, pool_release, &buffer_pool};
+    return pool;
+}
+
+void fs_pool_trim()
+{
+    // release every buffer the pool is holding on to
+    pthread_once(&buffer_pool.once, pool_init);
+    for (uint32_t i = 0; i < POOL_CLASSES; i++) {
+        fs_pool_class *c = &buffer_pool.classes[i];
+        pthread_mutex_lock(&c->lock);
+        void *ptr = c->free;
+        c->free = NULL;
+        c->count = 0;
+        pthread_mutex_unlock(&c->lock);
+        while (ptr) {
+            void *next = *(void **)ptr;
+            pool_raw_release(ptr, page_size << i);
+            ptr = next;
+        }
+    }
+}
+
+/*
+    Syscall wrappers.
+    Without CSTREAM_STATS they are the plain calls.
+*/
+#if defined(CSTREAM_STATS)
+#define stats_add(fs, field, n)                                                \
+    __atomic_fetch_add(&(fs)->stats.field, (n), __ATOMIC_RELAXED)
+
+static inline uint64_t stats_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void stats_record(file_stream *fs, fs_stats_op op, ssize_t opres,
+                         uint64_t start)
+{
+    uint64_t ns = stats_now() - start;
+    uint32_t bucket = 63 - __builtin_clzll(ns | 1);
+    bucket = MIN(bucket, STATS_BUCKETS - 1);
+    int32_t error = errno;
+    stats_add(fs, calls[op], 1);
+    stats_add(fs, latency[op][bucket], 1);
+    if (opres == -1) {
+        stats_add(fs, errors[op], 1);
+    } else if (op != STATS_SEEK) {
+        stats_add(fs, bytes[op], opres);
+    }
+    errno = error;
+}
+#else
+#define stats_add(fs, field, n)
+#endif
+
+static inline ssize_t fs_sys_read(file_stream *fs, void *b, size_t n)
+{
+#if defined(CSTREAM_STATS)
+    uint64_t start = stats_now();
+    ssize_t opres = read(fs->fd, b, n);
+    stats_record(fs, STATS_READ, opres, start);
+    if (opres != -1 && (size_t)opres < n) {
+        stats_add(fs, short_reads, 1);
+    }
+    return opres;
+#else
+    return read(fs->fd, b, n);
+#endif
+}
+
+static inline ssize_t fs_sys_pread(file_stream *fs, void *b, size_t n, off_t o)
+{
+#if defined(CSTREAM_STATS)
+    uint64_t start = stats_now();
+    ssize_t opres = pread(fs->fd, b, n, o);
+    stats_record(fs, STATS_READ, opres, start);
+    if (opres != -1 && (size_t)opres < n) {
+        stats_add(fs, short_reads, 1);
+    }
+    return opres;
+#else
+    return pread(fs->fd, b, n, o);
+#endif
+}
+
+static uint64_t stream_generation = 0;
+
+static inline void stream_touch(file_stream *fs)
+{
+    // a new tag, unique across all streams
+    uint64_t gen = __atomic_add_fetch(&stream_generation, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&fs->generation, gen, __ATOMIC_RELEASE);
+}
+
+static inline void store_max(size_t *p, size_t value)
+{
+    size_t seen = __atomic_load_n(p, __ATOMIC_RELAXED);
+    while (seen < value &&
+           !__atomic_compare_exchange_n(p, &seen, value, 1, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+    }
+}
+
+static inline ssize_t fs_sys_write(file_stream *fs, const void *b, size_t n)
+{
+#if defined(CSTREAM_STATS)
+    uint64_t start = stats_now();
+    ssize_t opres = write(fs->fd, b, n);
+    stats_record(fs, STATS_WRITE, opres, start);
+#else
+    ssize_t opres = write(fs->fd, b, n);
+#endif
+    stream_touch(fs);
+    return opres;
+}
+
+static inline ssize_t fs_sys_pwrite_fd(file_stream *fs, int32_t fd,
+                                       const void *b, size_t n, off_t o)
+{
+#if defined(CSTREAM_STATS)
+    uint64_t start = stats_now();
+    ssize_t opres = pwrite(fd, b, n, o);
+    stats_record(fs, STATS_WRITE, opres, start);
+#else
+    ssize_t opres = pwrite(fd, b, n, o);
+#endif
+    stream_touch(fs);
+    return opres;
+}
+
+static inline ssize_t fs_sys_pwrite(file_stream *fs, const void *b, size_t n,
+                                    off_t o)
+{
+    return fs_sys_pwrite_fd(fs, fs->fd, b, n, o);
+}
+
+static inline off_t fs_sys_lseek(file_stream *fs, off_t o, int32_t whence)
+{
+#if defined(CSTREAM_STATS)
+    uint64_t start = stats_now();
+    off_t opres = lseek(fs->fd, o, whence);
+    stats_record(fs, STATS_SEEK, opres == -1 ? -1 : 0, start);
+    return opres;
+#else
+    return lseek(fs->fd, o, whence);
+#endif
+}
+
+int32_t fs_stats_snapshot(file_stream *fs, fs_stats *out)
+{
+    /*
+        Copy the counters of a stream.
+        Returns -1 with ENOTSUP when built without CSTREAM_STATS.
+    */
+    memset(out, 0, sizeof(fs_stats));
+#if defined(CSTREAM_STATS)
+    uint64_t *src = (uint64_t *)&fs->stats;
+    uint64_t *dst = (uint64_t *)out;
+    for (size_t i = 0; i < sizeof(fs_stats) / sizeof(uint64_t); i++) {
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+    return 0;
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+void fs_stats_reset(file_stream *fs)
+{
+#if defined(CSTREAM_STATS)
+    uint64_t *dst = (uint64_t *)&fs->stats;
+    for (size_t i = 0; i < sizeof(fs_stats) / sizeof(uint64_t); i++) {
+        __atomic_store_n(&dst[i], 0, __ATOMIC_RELAXED);
+    }
+#endif
+}
+
+typedef enum fs_prefetch_state_e {
+    PREFETCH_IDLE = 0,
+    PREFETCH_PENDING = 1,
+    PREFETCH_READY = 2,
+    PREFETCH_EXIT = 3
+} fs_prefetch_state;
+
+typedef struct fs_prefetch_t
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    fs_prefetch_state state;
+    // the block we hand out, and the block in flight.
+    // each block is headroom bytes followed by chunk bytes.
+    uint8_t *front;
+    uint8_t *back;
+    size_t headroom;
+    size_t chunk;
+    // the request in flight
+    size_t offset;
+    ssize_t size;
+} fs_prefetch;
+
+static void *prefetch_main(void *arg)
+{
+    /*
+        The helper reads the next chunk into the back block,
+        while the stream hands out the front block.
+    */
+    file_stream *fs = (file_stream *)arg;
+    fs_prefetch *pf = fs->prefetch;
+    pthread_mutex_lock(&pf->lock);
+    for (;;) {
+        while (pf->state == PREFETCH_IDLE || pf->state == PREFETCH_READY) {
+            pthread_cond_wait(&pf->cond, &pf->lock);
+        }
+        if (pf->state == PREFETCH_EXIT) {
+            break;
+        }
+        uint8_t *dst = pf->back + pf->headroom;
+        size_t offset = pf->offset;
+        size_t chunk = pf->chunk;
+        pthread_mutex_unlock(&pf->lock);
+        ssize_t opres = fs_sys_pread(fs, dst, chunk, offset);
+        text_swap(fs, dst, offset, opres);
+        pthread_mutex_lock(&pf->lock);
+        pf->size = opres;
+        if (pf->state == PREFETCH_PENDING) {
+            pf->state = PREFETCH_READY;
+        }
+        pthread_cond_broadcast(&pf->cond);
+    }
+    pthread_mutex_unlock(&pf->lock);
+    return NULL;
+}
+
+static void prefetch_issue(fs_prefetch *pf, size_t offset)
+{
+    pthread_mutex_lock(&pf->lock);
+    pf->offset = offset;
+    pf->size = 0;
+    pf->state = PREFETCH_PENDING;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+}
+
+static ssize_t prefetch_wait(fs_prefetch *pf)
+{
+    // wait for the block in flight, and take it.
+    pthread_mutex_lock(&pf->lock);
+    while (pf->state == PREFETCH_PENDING) {
+        pthread_cond_wait(&pf->cond, &pf->lock);
+    }
+    ssize_t opres = pf->state == PREFETCH_READY ? pf->size : 0;
+    pf->state = PREFETCH_IDLE;
+    pthread_mutex_unlock(&pf->lock);
+    return opres;
+}
+
+static ssize_t prefetch_take(fs_prefetch *pf, size_t offset)
+{
+    // take the block at offset, reading it now if nothing is in flight.
+    pthread_mutex_lock(&pf->lock);
+    if (pf->state == PREFETCH_IDLE) {
+        pf->offset = offset;
+        pf->size = 0;
+        pf->state = PREFETCH_PENDING;
+        pthread_cond_broadcast(&pf->cond);
+    }
+    pthread_mutex_unlock(&pf->lock);
+    return prefetch_wait(pf);
+}
+
+static int32_t prefetch_blocks(fs_prefetch *pf, size_t headroom, size_t chunk,
+                               uint8_t *keep, size_t keep_size)
+{
+    /*
+        (Re)allocate both blocks. The keep range is copied
+        to the end of the new front headroom.
+    */
+    uint8_t *front = alloc_buffer(headroom + chunk);
+    uint8_t *back = alloc_buffer(headroom + chunk);
+    if (front == NULL || back == NULL) {
+        release_buffer(front, headroom + chunk);
+        release_buffer(back, headroom + chunk);
+        return -1;
+    }
+    if (keep_size > 0) {
+        memcpy(front + headroom - keep_size, keep, keep_size);
+    }
+    release_buffer(pf->front, pf->headroom + pf->chunk);
+    release_buffer(pf->back, pf->headroom + pf->chunk);
+    pf->front = front;
+    pf->back = back;
+    pf->headroom = headroom;
+    pf->chunk = chunk;
+    return 0;
+}
+
+static int32_t prefetch_open(file_stream *fs)
+{
+    fs_prefetch *pf = (fs_prefetch *)calloc(1, sizeof(fs_prefetch));
+    if (pf == NULL ||
+        prefetch_blocks(pf, page_size, read_ahead_size, NULL, 0) == -1) {
+        free(pf);
+        return -1;
+    }
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->cond, NULL);
+    fs->prefetch = pf;
+    if (pthread_create(&pf->thread, NULL, prefetch_main, fs) != 0) {
+        pthread_cond_destroy(&pf->cond);
+        pthread_mutex_destroy(&pf->lock);
+        release_buffer(pf->front, pf->headroom + pf->chunk);
+        release_buffer(pf->back, pf->headroom + pf->chunk);
+        free(pf);
+        fs->prefetch = NULL;
+        return -1;
+    }
+    fs->buffer = pf->front + pf->headroom;
+    fs->buffer_size = 0;
+    // get the first block going right away
+    prefetch_issue(pf, 0);
+    return 0;
+}
+
+static void prefetch_close(file_stream *fs)
+{
+    fs_prefetch *pf = fs->prefetch;
+    pthread_mutex_lock(&pf->lock);
+    pf->state = PREFETCH_EXIT;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+    pthread_join(pf->thread, NULL);
+    pthread_cond_destroy(&pf->cond);
+    pthread_mutex_destroy(&pf->lock);
+    release_buffer(pf->front, pf->headroom + pf->chunk);
+    release_buffer(pf->back, pf->headroom + pf->chunk);
+    free(pf);
+    fs->prefetch = NULL;
+    fs->buffer = NULL;
+}
+
+static size_t prefetch_stream_read(file_stream *fs, size_t sm)
+{
+    /*
+        Swap in the block that was read ahead. The unread tail of
+        the current block is copied into the headroom in front of it,
+        so the requested range stays contiguous. That tail is always
+        shorter than the request.
+    */
+    fs_prefetch *pf = fs->prefetch;
+    if (fs->file_ptr == fs->file_size) {
+        return 0;
+    }
+    size_t left = fs->file_ptr - fs->buffer_ptr;
+    uint8_t *tail = &fs->buffer[fs->buffer_size - left];
+    if (sm > pf->headroom) {
+        /*
+            A rare request larger than our headroom.
+            Grow both blocks, and read ahead again.
+        */
+        prefetch_wait(pf);
+        size_t headroom = MAX(next_page_multiple(sm), pf->headroom * 2);
+        if (prefetch_blocks(pf, headroom, MAX(pf->chunk, headroom), tail,
+                            left) == -1) {
+            return 0;
+        }
+        tail = pf->front + pf->headroom - left;
+        fs->buffer = tail;
+        fs->buffer_size = left;
+    }
+
+    ssize_t opres = prefetch_take(pf, fs->file_ptr);
+    if (opres <= 0) {
+        return 0;
+    }
+    uint8_t *front = pf->back;
+    pf->back = pf->front;
+    pf->front = front;
+    fs->buffer = front + pf->headroom - left;
+    memcpy(fs->buffer, tail, left);
+    fs->buffer_size = left + opres;
+    fs->file_ptr += opres;
+    if (fs->file_ptr < fs->file_size) {
+        prefetch_issue(pf, fs->file_ptr);
+    }
+    checksum_fill(fs, fs->file_ptr - opres, &fs->buffer[left], opres);
+    return opres;
+}
+
+static int64_t prefetch_seek(file_stream *fs, int64_t offset, int32_t whence)
+{
+    /*
+        The helper reads with pread, so the descriptor offset
+        is never moved. We seek relative to our own cursor.
+    */
+    fs_prefetch *pf = fs->prefetch;
+    int64_t target = offset;
+    if (whence == SEEK_CUR) {
+        target += fs->buffer_ptr;
+    } else if (whence == SEEK_END) {
+        target += fs->file_size;
+    }
+    if (target < 0) {
+        return -1;
+    }
+    target = MIN((size_t)target, fs->file_size);
+    if ((size_t)target <= fs->file_ptr &&
+        (size_t)target + fs->buffer_size >= fs->file_ptr) {
+        // still within our current block
+        fs->buffer_ptr = target;
+        return target;
+    }
+    prefetch_wait(pf);
+    fs->buffer = pf->front + pf->headroom;
+    fs->buffer_size = 0;
+    fs->buffer_ptr = target;
+    fs->file_ptr = target;
+    if (fs->file_ptr < fs->file_size) {
+        prefetch_issue(pf, fs->file_ptr);
+    }
+    return target;
+}
+
+typedef struct fs_flusher_t
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    // a small ring of blocks. the stream fills one,
+    // the others wait for or sit on the disk.
+    uint8_t *blocks[WRITE_BEHIND_SLOTS];
+    size_t offsets[WRITE_BEHIND_SLOTS];
+    size_t sizes[WRITE_BEHIND_SLOTS];
+    size_t block_size;
+    uint32_t fill;
+    uint32_t head;
+    uint32_t pending;
+    int32_t exit;
+    // the first error we could not report yet
+    int32_t error;
+} fs_flusher;
+
+static void *flusher_main(void *arg)
+{
+    /*
+        The helper writes queued blocks in order, at their own offsets.
+    */
+    file_stream *fs = (file_stream *)arg;
+    fs_flusher *fl = fs->flusher;
+    pthread_mutex_lock(&fl->lock);
+    for (;;) {
+        while (fl->pending == 0 && !fl->exit) {
+            pthread_cond_wait(&fl->cond, &fl->lock);
+        }
+        if (fl->pending == 0) {
+            break;
+        }
+        uint8_t *block = fl->blocks[fl->head];
+        size_t offset = fl->offsets[fl->head];
+        size_t size = fl->sizes[fl->head];
+        pthread_mutex_unlock(&fl->lock);
+        int32_t error = 0;
+        while (size > 0) {
+            ssize_t opres = fs_sys_pwrite(fs, block, size, offset);
+            if (opres == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                error = errno;
+                break;
+            }
+            block += opres;
+            offset += opres;
+            size -= opres;
+        }
+        pthread_mutex_lock(&fl->lock);
+        if (error && !fl->error) {
+            fl->error = error;
+        }
+        fl->head = (fl->head + 1) % WRITE_BEHIND_SLOTS;
+        fl->pending--;
+        pthread_cond_broadcast(&fl->cond);
+    }
+    pthread_mutex_unlock(&fl->lock);
+    return NULL;
+}
+
+static void flusher_submit(fs_flusher *fl, size_t offset, size_t size)
+{
+    // queue the block we filled, and wait until the next one is free.
+    pthread_mutex_lock(&fl->lock);
+    fl->offsets[fl->fill] = offset;
+    fl->sizes[fl->fill] = size;
+    fl->fill = (fl->fill + 1) % WRITE_BEHIND_SLOTS;
+    fl->pending++;
+    pthread_cond_broadcast(&fl->cond);
+    while (fl->pending == WRITE_BEHIND_SLOTS) {
+        pthread_cond_wait(&fl->cond, &fl->lock);
+    }
+    pthread_mutex_unlock(&fl->lock);
+}
+
+static int32_t flusher_drain(fs_flusher *fl)
+{
+    // wait for every queued block, and hand back any deferred error.
+    pthread_mutex_lock(&fl->lock);
+    while (fl->pending > 0) {
+        pthread_cond_wait(&fl->cond, &fl->lock);
+    }
+    int32_t error = fl->error;
+    fl->error = 0;
+    pthread_mutex_unlock(&fl->lock);
+    return error;
+}
+
+static int32_t flusher_blocks(fs_flusher *fl, size_t block_size)
+{
+    // only call this with nothing in flight
+    uint8_t *blocks[WRITE_BEHIND_SLOTS];
+    for (uint32_t i = 0; i < WRITE_BEHIND_SLOTS; i++) {
+        blocks[i] = alloc_buffer(block_size);
+        if (blocks[i] == NULL) {
+            while (i > 0) {
+                release_buffer(blocks[--i], block_size);
+            }
+            return -1;
+        }
+    }
+    for (uint32_t i = 0; i < WRITE_BEHIND_SLOTS; i++) {
+        release_buffer(fl->blocks[i], fl->block_size);
+        fl->blocks[i] = blocks[i];
+    }
+    fl->block_size = block_size;
+    return 0;
+}
+
+static int32_t flusher_open(file_stream *fs)
+{
+    fs_flusher *fl = (fs_flusher *)calloc(1, sizeof(fs_flusher));
+    if (fl == NULL || flusher_blocks(fl, write_behind_size) == -1) {
+        free(fl);
+        return -1;
+    }
+    pthread_mutex_init(&fl->lock, NULL);
+    pthread_cond_init(&fl->cond, NULL);
+    fs->flusher = fl;
+    if (pthread_create(&fl->thread, NULL, flusher_main, fs) != 0) {
+        pthread_cond_destroy(&fl->cond);
+        pthread_mutex_destroy(&fl->lock);
+        for (uint32_t i = 0; i < WRITE_BEHIND_SLOTS; i++) {
+            release_buffer(fl->blocks[i], fl->block_size);
+        }
+        free(fl);
+        fs->flusher = NULL;
+        return -1;
+    }
+    fs->buffer = fl->blocks[fl->fill];
+    fs->buffer_size = fl->block_size;
+    if (fs->mode & APPEND) {
+        // blocks go out at their own offsets, start them at the end
+        fs->file_ptr = fs->file_size;
+        fs->buffer_ptr = fs->file_size;
+    }
+    return 0;
+}
+
+static void flusher_close(file_stream *fs)
+{
+    fs_flusher *fl = fs->flusher;
+    pthread_mutex_lock(&fl->lock);
+    fl->exit = 1;
+    pthread_cond_broadcast(&fl->cond);
+    pthread_mutex_unlock(&fl->lock);
+    pthread_join(fl->thread, NULL);
+    pthread_cond_destroy(&fl->cond);
+    pthread_mutex_destroy(&fl->lock);
+    for (uint32_t i = 0; i < WRITE_BEHIND_SLOTS; i++) {
+        release_buffer(fl->blocks[i], fl->block_size);
+    }
+    free(fl);
+    fs->flusher = NULL;
+    fs->buffer = NULL;
+}
+
+static int32_t behind_flush(file_stream *fs)
+{
+    fs_flusher *fl = fs->flusher;
+    if (fs->buffer_ptr > fs->file_ptr) {
+        checksum_update(fs, fs->file_ptr, fs->buffer,
+                        fs->buffer_ptr - fs->file_ptr);
+        flusher_submit(fl, fs->file_ptr, fs->buffer_ptr - fs->file_ptr);
+        fs->file_ptr = fs->buffer_ptr;
+        fs->buffer = fl->blocks[fl->fill];
+    }
+    int32_t error = flusher_drain(fl);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+static size_t behind_stream_write(file_stream *fs, size_t sm)
+{
+    /*
+        Hand the full block to the flusher and continue in the next one.
+        We only block when every block in the ring is still in flight.
+    */
+    fs_flusher *fl = fs->flusher;
+    if (fs->buffer_ptr > fs->file_ptr) {
+        checksum_update(fs, fs->file_ptr, fs->buffer,
+                        fs->buffer_ptr - fs->file_ptr);
+        flusher_submit(fl, fs->file_ptr, fs->buffer_ptr - fs->file_ptr);
+        fs->file_ptr = fs->buffer_ptr;
+        fs->buffer = fl->blocks[fl->fill];
+    }
+    if (sm > fs->buffer_size) {
+        /*
+            A rare case where the size is larger then our blocks.
+        */
+        int32_t error = flusher_drain(fl);
+        if (error || flusher_blocks(fl, next_page_multiple(sm)) == -1) {
+            // a deferred write failed, or we got no bigger blocks
+            errno = error ? error : ENOMEM;
+            return 0;
+        }
+        fs->buffer = fl->blocks[fl->fill];
+        fs->buffer_size = fl->block_size;
+    }
+    return fs->buffer_size;
+}
+
+/*
+    Sparse files.
+    A sparse reader maps the data extents of its file at open, with
+    SEEK_DATA and SEEK_HOLE. Fills read only the data and zero the holes
+    in memory. fs_extent_at tells whether the cursor sits in data or in a
+    hole and how far it reaches, so a hole can be passed with fs_seek
+    without filling it at all. The map is the file as it was at open.
+    A sparse writer punches a hole for every whole page of zeros it
+    flushes, instead of writing it, and skips zeros past the end.
+*/
+typedef struct fs_extent_t
+{
+    size_t offset;
+    size_t size;
+    // a hole reads as size zero bytes
+    int32_t hole;
+} fs_extent;
+
+#if defined(LINUX)
+static int32_t extents_push(file_stream *fs, size_t offset, size_t size,
+                            uint32_t *capacity)
+{
+    if (fs->extent_count == *capacity) {
+        *capacity = MAX(*capacity * 2, 16);
+        fs_extent *extents =
+            (fs_extent *)realloc(fs->extents, *capacity * sizeof(fs_extent));
+        if (extents == NULL) {
+            return -1;
+        }
+        fs->extents = extents;
+    }
+    fs_extent *e = &fs->extents[fs->extent_count++];
+    e->offset = offset;
+    e->size = size;
+    e->hole = 0;
+    return 0;
+}
+#endif
+
+static int32_t extents_scan(file_stream *fs)
+{
+    // the file system may not know, then everything is data
+#if defined(LINUX)
+    size_t offset = 0;
+    uint32_t capacity = 0;
+    while (offset < fs->file_size) {
+        off_t data = lseek(fs->fd, offset, SEEK_DATA);
+        if (data == -1) {
+            // nothing but a hole up to the end
+            return errno == ENXIO ? 0 : -1;
+        }
+        off_t hole = lseek(fs->fd, data, SEEK_HOLE);
+        if (hole == -1) {
+            return -1;
+        }
+        hole = MIN((size_t)hole, fs->file_size);
+        if (extents_push(fs, data, hole - data, &capacity) == -1) {
+            return -1;
+        }
+        offset = hole;
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+static void extents_map(file_stream *fs)
+{
+    int32_t res = extents_scan(fs);
+    lseek(fs->fd, 0, SEEK_SET);
+    if (res == -1 || (fs->extent_count == 1 && fs->extents[0].offset == 0 &&
+                      fs->extents[0].size == fs->file_size)) {
+        // no holes to skip, read it as any other file
+        free(fs->extents);
+        fs->extents = NULL;
+        fs->extent_count = 0;
+    }
+}
+
+static uint32_t extent_find(file_stream *fs, size_t offset)
+{
+    // the first data extent that ends past offset
+    uint32_t lo = 0;
+    uint32_t hi = fs->extent_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        fs_extent *e = &fs->extents[mid];
+        if (e->offset + e->size <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static ssize_t sparse_read(file_stream *fs, uint8_t *buffer, size_t offset,
+                           size_t size)
+{
+    /*
+        Fill buffer with [offset, offset + size) of the file,
+        reading the data extents and zeroing the holes.
+    */
+    size = MIN(size, fs->file_size - MIN(offset, fs->file_size));
+    uint32_t i = extent_find(fs, offset);
+    size_t done = 0;
+    while (done < size) {
+        size_t at = offset + done;
+        size_t from = fs->file_size;
+        size_t to = fs->file_size;
+        if (i < fs->extent_count) {
+            from = fs->extents[i].offset;
+            to = from + fs->extents[i].size;
+        }
+        if (at < from) {
+            size_t n = MIN(from, offset + size) - at;
+            memset(&buffer[done], 0, n);
+            done += n;
+            continue;
+        }
+        size_t n = MIN(to, offset + size) - at;
+        ssize_t opres = fs_sys_pread(fs, &buffer[done], n, at);
+        if (opres == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return done > 0 ? (ssize_t)done : -1;
+        }
+        if (opres == 0) {
+            // the file got shorter since we mapped it
+            break;
+        }
+        done += opres;
+        if (at + opres == to) {
+            i++;
+        }
+    }
+    return done;
+}
+
+static inline ssize_t fill_read(file_stream *fs, size_t offset, size_t size)
+{
+    // plain reads go from the descriptor, which sits at offset
+    if (fs->extents) {
+        return sparse_read(fs, fs->buffer, offset, size);
+    }
+    return fs_sys_read(fs, fs->buffer, size);
+}
+
+int32_t fs_extent_at(file_stream *fs, fs_extent *e)
+{
+    /*
+        The extent at the cursor, from the cursor to its end.
+        Streams without holes are one data extent.
+        Returns -1 at the end of the file.
+    */
+    size_t cursor = fs->buffer_ptr;
+    if (cursor >= fs->file_size) {
+        return -1;
+    }
+    e->offset = cursor;
+    e->size = fs->file_size - cursor;
+    e->hole = 0;
+    if (fs->extents == NULL) {
+        return 0;
+    }
+    uint32_t i = extent_find(fs, cursor);
+    if (i == fs->extent_count) {
+        e->hole = 1;
+    } else if (fs->extents[i].offset > cursor) {
+        e->hole = 1;
+        e->size = fs->extents[i].offset - cursor;
+    } else {
+        e->size = fs->extents[i].offset + fs->extents[i].size - cursor;
+    }
+    return 0;
+}
+
+static inline int32_t is_zero(const uint8_t *p, size_t n)
+{
+    return p[0] == 0 && memcmp(p, p + 1, n - 1) == 0;
+}
+
+static int32_t punch_hole(file_stream *fs, size_t offset, size_t size)
+{
+#if defined(LINUX)
+    return fallocate(fs->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                     offset, size);
+#else
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+static int32_t write_sparse_run(file_stream *fs, size_t done, size_t size,
+                                int32_t zero)
+{
+    if (zero && punch_hole(fs, fs->file_ptr + done, size) == 0) {
+        return 0;
+    }
+    // data, or zeros where we can not punch
+    size_t n = 0;
+    while (n < size) {
+        ssize_t opres = fs_sys_pwrite(fs, &fs->buffer[done + n], size - n,
+                                      fs->file_ptr + done + n);
+        if (opres == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        n += opres;
+    }
+    return 0;
+}
+
+static int32_t write_sparse(file_stream *fs, size_t size)
+{
+    /*
+        write_all for sparse writers. Runs of whole file pages that are
+        all zero become holes, the rest is written. Zeros past the end
+        of the file already read as zero, those are not written at all,
+        a hole at the end is kept in the file by its size.
+    */
+    struct stat stats;
+    if (fstat(fs->fd, &stats) == -1) {
+        return -1;
+    }
+    size_t end = stats.st_size;
+    size_t done = 0;
+    int32_t res = 0;
+    while (done < size && res == 0) {
+        size_t run = 0;
+        int32_t zero = -1;
+        while (done + run < size) {
+            size_t at = fs->file_ptr + done + run;
+            size_t n = MIN(prev_page_multiple(at) + page_size - at,
+                           size - (done + run));
+            int32_t page_zero = (n == page_size || at >= end) &&
+                                is_zero(&fs->buffer[done + run], n);
+            if (zero != -1 && page_zero != zero) {
+                break;
+            }
+            zero = page_zero;
+            run += n;
+        }
+        size_t at = fs->file_ptr + done;
+        if (!zero || at < end) {
+            res = write_sparse_run(fs, done, run, zero);
+        }
+        if (res == 0) {
+            done += run;
+            if (!zero) {
+                end = MAX(end, at + run);
+            }
+        }
+    }
+    if (res == 0 && end < fs->file_ptr + done &&
+        ftruncate(fs->fd, fs->file_ptr + done) == -1) {
+        res = -1;
+    }
+    int32_t error = errno;
+    // the descriptor follows our cursor, as after write_all
+    fs_sys_lseek(fs, fs->file_ptr + done, SEEK_SET);
+    checksum_update(fs, fs->file_ptr, fs->buffer, done);
+    memmove(fs->buffer, &fs->buffer[done],
+            (fs->buffer_ptr - fs->file_ptr) - done);
+    fs->file_ptr += done;
+    errno = error;
+    return res;
+}
+
+static int32_t write_all(file_stream *fs, size_t size)
+{
+    /*
+        Write the first size bytes of our buffer at file_ptr.
+        What could not be written is kept at the buffer start.
+    */
+    if (fs->mode & SPARSE) {
+        return write_sparse(fs, size);
+    }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t opres = fs_sys_write(fs, &fs->buffer[done], size - done);
+        if (opres == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            checksum_update(fs, fs->file_ptr, fs->buffer, done);
+            memmove(fs->buffer, &fs->buffer[done],
+                    (fs->buffer_ptr - fs->file_ptr) - done);
+            fs->file_ptr += done;
+            return -1;
+        }
+        done += opres;
+    }
+    checksum_update(fs, fs->file_ptr, fs->buffer, done);
+    memmove(fs->buffer, &fs->buffer[done],
+            (fs->buffer_ptr - fs->file_ptr) - done);
+    fs->file_ptr += done;
+    return 0;
+}
+
+static int32_t write_direct_tail(file_stream *fs, size_t aligned, size_t tail)
+{
+    /*
+        Direct io only moves whole pages. The unaligned tail is written
+        through the page cache, on a descriptor of its own so positional
+        io on fd stays direct, and kept in our buffer so the next flush
+        writes its page again in full.
+    */
+    int32_t fd = fs->tail_fd != -1 ? fs->tail_fd : fs->fd;
+    size_t done = 0;
+    while (done < tail) {
+        ssize_t opres =
+            fs_sys_pwrite_fd(fs, fd, &fs->buffer[aligned + done],
+                             tail - done, fs->file_ptr + aligned + done);
+        if (opres == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += opres;
+    }
+    return 0;
+}
+
+static int32_t flush_direct(file_stream *fs, int32_t all)
+{
+    /*
+        file_ptr always sits on a page in direct mode.
+        Write the whole pages, and keep the partial one.
+    */
+    size_t pending = fs->buffer_ptr - fs->file_ptr;
+    size_t aligned = prev_page_multiple(pending);
+    size_t tail = pending - aligned;
+    if (all && tail > 0 && write_direct_tail(fs, aligned, tail) == -1) {
+        return -1;
+    }
+    // write_all keeps the tail at the buffer start for us
+    if (aligned > 0 && write_all(fs, aligned) == -1) {
+        return -1;
+    }
+    if (all && tail > 0) {
+        // the tail went out first, it counts after the whole pages
+        checksum_update(fs, fs->file_ptr, fs->buffer, tail);
+    }
+    return 0;
+}
+
+// sends what a sink holds of our buffer, see fs_sink_span
+static void sink_release(file_stream *fs);
+
+int32_t fs_flush(file_stream *fs)
+{
+    /*
+        Write out what is pending in our buffer.
+        Returns -1 with errno set when a write failed,
+        including writes deferred to the flusher.
+    */
+    if (fs->sink && (fs->mode & WRITE)) {
+        // the pending bytes move or get reused once written
+        sink_release(fs);
+    }
+    if (fs->mode & WRITE_BEHIND) {
+        return behind_flush(fs);
+    }
+    if ((fs->mode & (MAPPED | WRITE)) == (MAPPED | WRITE)) {
+        /*
+            The writes are in the page cache already,
+            we only note how far they reach.
+        */
+        store_max(&fs->file_size, fs->buffer_ptr);
+        stream_touch(fs);
+        if (fs->buffer_ptr > fs->digest_end) {
+            checksum_update(fs, fs->digest_end, &fs->buffer[fs->digest_end],
+                            fs->buffer_ptr - fs->digest_end);
+        }
+        return 0;
+    }
+    if (!(fs->mode & WRITE) || (fs->buffer_ptr <= fs->file_ptr)) {
+        return 0;
+    }
+    if (fs->mode & DIRECT) {
+        return flush_direct(fs, 1);
+    }
+    return write_all(fs, fs->buffer_ptr - fs->file_ptr);
+}
+
+static int64_t behind_seek(file_stream *fs, int64_t offset, int32_t whence)
+{
+    /*
+        The flusher writes with pwrite, so the descriptor offset
+        is never moved. We seek relative to our own cursor.
+    */
+    if (fs_flush(fs) == -1) {
+        return -1;
+    }
+    int64_t target = offset;
+    if (whence == SEEK_CUR) {
+        target += fs->buffer_ptr;
+    } else if (whence == SEEK_END) {
+        struct stat stats;
+        if (fstat(fs->fd, &stats) == -1) {
+            return -1;
+        }
+        target += stats.st_size;
+    }
+    if (target < 0) {
+        return -1;
+    }
+    checksum_seek(fs, target);
+    fs->buffer_ptr = target;
+    fs->file_ptr = target;
+    return target;
+}
+
+static void os_advise(file_stream *fs, fs_advice advice)
+{
+    if (fs->os_advice == advice) {
+        return;
+    }
+    fs->os_advice = advice;
+#if defined(POSIX_FADV_RANDOM)
+    posix_fadvise(fs->fd, 0, 0,
+                  advice == ADVISE_RANDOM       ? POSIX_FADV_RANDOM
+                  : advice == ADVISE_SEQUENTIAL ? POSIX_FADV_SEQUENTIAL
+                                                : POSIX_FADV_NORMAL);
+#endif
+}
+
+static void set_capacity(file_stream *fs, size_t capacity)
+{
+    /*
+        Only call this right before a refill,
+        nothing in the buffer survives it.
+    */
+    capacity = next_page_multiple(capacity);
+    if (capacity == fs->buffer_capacity) {
+        return;
+    }
+    uint8_t *buffer = alloc_buffer(capacity);
+    if (buffer == NULL) {
+        return;
+    }
+    release_buffer(fs->buffer, fs->buffer_capacity);
+    fs->buffer = buffer;
+    fs->buffer_capacity = capacity;
+}
+
+static void adapt_fill(file_stream *fs)
+{
+    /*
+        We refill because the reader ran past our buffer. Keep doubling
+        the buffer while that happens in a row, up to our limit.
+    */
+    if ((fs->mode & WRITE) || fs->advice == ADVISE_RANDOM) {
+        return;
+    }
+    fs->random = 0;
+    if (fs->advice == ADVISE_NORMAL) {
+        if (fs->sequential < SEQUENTIAL_FILLS) {
+            fs->sequential++;
+            return;
+        }
+        os_advise(fs, ADVISE_NORMAL);
+    }
+    size_t limit = MIN(fs->buffer_limit, next_page_multiple(fs->file_size));
+    if (fs->buffer_capacity < limit) {
+        size_t grow = fs->advice == ADVISE_SEQUENTIAL
+                          ? limit
+                          : MIN(fs->buffer_capacity * 2, limit);
+        set_capacity(fs, grow);
+    }
+}
+
+static void adapt_seek(file_stream *fs)
+{
+    /*
+        We refill because of a seek. When seeks keep landing outside
+        our buffer, read less around them, and tell the os.
+    */
+    if ((fs->mode & WRITE) || fs->advice == ADVISE_SEQUENTIAL) {
+        return;
+    }
+    fs->sequential = 0;
+    if (fs->advice == ADVISE_NORMAL) {
+        if (fs->random < RANDOM_SEEKS) {
+            fs->random++;
+            return;
+        }
+        os_advise(fs, ADVISE_RANDOM);
+    }
+    if (fs->buffer_capacity > random_size) {
+        set_capacity(fs, random_size);
+    }
+}
+
+int32_t fs_advise(file_stream *fs, fs_advice advice)
+{
+    /*
+        Tell the stream how it will be read, the buffer follows from
+        the next refill. ADVISE_NORMAL goes back to adapting the buffer
+        to what we see. The hint is passed on to the os where it takes.
+    */
+    if (fs_flush(fs) == -1) {
+        return -1;
+    }
+    fs->advice = advice;
+    fs->sequential = 0;
+    fs->random = 0;
+    os_advise(fs, advice);
+    return 0;
+}
+
+void fs_set_buffer_limit(file_stream *fs, size_t limit)
+{
+    // the largest buffer sequential reads grow into
+    fs->buffer_limit = MAX(next_page_multiple(limit), page_size);
+}
+
+static int64_t read_seek(file_stream *fs, size_t target)
+{
+    target = MIN(target, fs->file_size);
+    if ((target + fs->buffer_size) >= fs->file_ptr &&
+        target <= fs->file_ptr) {
+        // we have moved but are still within our current buffer.
+        fs->buffer_ptr = target;
+        return target;
+    }
+    // refill from the page we land in.
+    adapt_seek(fs);
+    size_t head = prev_page_multiple(target);
+    if (fs_sys_lseek(fs, head, SEEK_SET) == -1) {
+        return -1;
+    }
+    size_t next_size = MIN(fs->buffer_capacity, fs->file_size - head);
+    if (fs->mode & DIRECT) {
+        next_size = next_page_multiple(next_size);
+    }
+    ssize_t opres = 0;
+    if ((opres = fill_read(fs, head, next_size)) == -1) {
+        return -1;
+    }
+    if (opres > 0) {
+        checksum_update(fs, head, fs->buffer, opres);
+    }
+    text_swap(fs, fs->buffer, head, opres);
+    fs->file_ptr = head + opres;
+    fs->buffer_size = opres;
+    fs->buffer_ptr = target;
+    return target;
+}
+
+static int64_t write_seek(file_stream *fs, size_t target)
+{
+    size_t head = target;
+    checksum_seek(fs, target);
+    if ((fs->mode & DIRECT) && (target % page_size) != 0) {
+        /*
+            Land on a page, and read back the part in front of
+            our target so we can write the page in full.
+        */
+        head = prev_page_multiple(target);
+        ssize_t opres = fs_sys_pread(fs, fs->buffer, page_size, head);
+        if (opres == -1) {
+            return -1;
+        }
+        if ((size_t)opres < target - head) {
+            memset(&fs->buffer[opres], 0, (target - head) - opres);
+        }
+    }
+    if (fs_sys_lseek(fs, head, SEEK_SET) == -1) {
+        return -1;
+    }
+    fs->file_ptr = head;
+    fs->buffer_ptr = target;
+    return target;
+}
+
+int64_t fs_seek(file_stream *fs, int64_t offset, int32_t whence)
+{
+    if (fs->sink) {
+        sink_release(fs);
+    }
+    if (fs->mode & READ_AHEAD) {
+        return prefetch_seek(fs, offset, whence);
+    }
+    if (fs->mode & WRITE_BEHIND) {
+        return behind_seek(fs, offset, whence);
+    }
+    if (fs_flush(fs) == -1) {
+        return -1;
+    }
+    /*
+        The descriptor offset trails our cursor while reading,
+        so we seek relative to the cursor ourselves.
+    */
+    int64_t target = offset;
+    if (whence == SEEK_CUR) {
+        target += fs->buffer_ptr;
+    } else if (whence == SEEK_END) {
+        size_t size = __atomic_load_n(&fs->file_size, __ATOMIC_RELAXED);
+        if ((fs->mode & WRITE) && !(fs->mode & MAPPED)) {
+            struct stat stats;
+            if (fstat(fs->fd, &stats) == -1) {
+                return -1;
+            }
+            size = MAX((size_t)stats.st_size, fs->buffer_ptr);
+        }
+        target += size;
+    }
+    if (target < 0) {
+        // seek failed
+        errno = EINVAL;
+        return -1;
+    }
+    if (fs->mode & MAPPED) {
+        // the whole file is resident, we only move our cursor.
+        // writers grow the mapping on their next write.
+        if (!(fs->mode & WRITE)) {
+            target = MIN((size_t)target, fs->file_size);
+        } else {
+            checksum_seek(fs, target);
+        }
+        fs->buffer_ptr = target;
+        return fs->buffer_ptr;
+    }
+    if (fs->mode & WRITE) {
+        return write_seek(fs, target);
+    }
+    return read_seek(fs, target);
+}
+
+/*
+    Line index.
+    We keep the start of every LINE_INDEX_STRIDE'th line, so a seek to
+    line n lands at most a stride of lines in front of it. Lines end
+    with '\n'. The index can live next to the file in a sidecar, p.idx,
+    with the offsets delta encoded as varints. The sidecar records the
+    size and mtime of the file, and is rebuilt when they no longer match.
+*/
+typedef struct fs_line_index_t
+{
+    uint64_t file_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    // line starts in the file, and how many we keep
+    uint64_t lines;
+    uint64_t count;
+    uint64_t capacity;
+    uint64_t *offsets;
+} fs_line_index;
+
+typedef struct fs_line_header_t
+{
+    char magic[4];
+    uint32_t stride;
+    uint64_t file_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t lines;
+    uint64_t count;
+} fs_line_header;
+
+static const char line_index_magic[4] = {'C', 'S', 'L', '1'};
+
+static void line_index_free(fs_line_index *li)
+{
+    if (li) {
+        free(li->offsets);
+        free(li);
+    }
+}
+
+static void stat_mtime(struct stat *stats, int64_t *sec, int64_t *nsec)
+{
+#if defined(LINUX)
+    *sec = stats->st_mtim.tv_sec;
+    *nsec = stats->st_mtim.tv_nsec;
+#else
+    // whole seconds, where we do not know the name of the rest
+    *sec = stats->st_mtime;
+    *nsec = 0;
+#endif
+}
+
+static fs_line_index *line_index_new(struct stat *stats)
+{
+    fs_line_index *li = (fs_line_index *)calloc(1, sizeof(fs_line_index));
+    if (li == NULL) {
+        return NULL;
+    }
+    li->file_size = stats->st_size;
+    stat_mtime(stats, &li->mtime_sec, &li->mtime_nsec);
+    return li;
+}
+
+static int32_t line_index_push(fs_line_index *li, uint64_t offset)
+{
+    if (li->count == li->capacity) {
+        uint64_t capacity = MAX(li->capacity * 2, 1024);
+        uint64_t *offsets =
+            (uint64_t *)realloc(li->offsets, capacity * sizeof(uint64_t));
+        if (offsets == NULL) {
+            return -1;
+        }
+        li->offsets = offsets;
+        li->capacity = capacity;
+    }
+    li->offsets[li->count++] = offset;
+    return 0;
+}
+
+static int32_t line_index_scan(fs_line_index *li, const uint8_t *p, size_t n,
+                               uint64_t base, size_t *k)
+{
+    /*
+        Count the newlines in a span at base, and keep the start of
+        every stride'th line. k carries the lines left to the next one.
+    */
+    size_t pos = 0;
+    while (pos < n) {
+        pos += scan_table.nth_8(&p[pos], n - pos, '\n', k);
+        if (*k > 0) {
+            break;
+        }
+        li->lines += LINE_INDEX_STRIDE;
+        *k = LINE_INDEX_STRIDE;
+        if ((base + pos) < li->file_size &&
+            line_index_push(li, base + pos) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static fs_line_index *line_index_build(int32_t fd, struct stat *stats)
+{
+    /*
+        One pass over the file, through a mapping when we get one.
+    */
+    fs_line_index *li = line_index_new(stats);
+    if (li == NULL) {
+        return NULL;
+    }
+    size_t size = stats->st_size;
+    size_t k = LINE_INDEX_STRIDE;
+    uint8_t last = '\n';
+    int32_t res = 0;
+    if (size > 0) {
+        res = line_index_push(li, 0);
+    }
+    uint8_t *m = size > 0 ? (uint8_t *)mmap(NULL, size, PROT_READ,
+                                            MAP_PRIVATE, fd, 0)
+                          : (uint8_t *)MAP_FAILED;
+    if (res == 0 && m != MAP_FAILED) {
+        madvise(m, size, MADV_SEQUENTIAL);
+        res = line_index_scan(li, m, size, 0, &k);
+        last = m[size - 1];
+        munmap(m, size);
+    } else if (res == 0 && size > 0) {
+        uint8_t *buffer = alloc_buffer(read_ahead_size);
+        size_t offset = 0;
+        res = buffer ? 0 : -1;
+        while (res == 0 && offset < size) {
+            ssize_t opres = pread(fd, buffer, read_ahead_size, offset);
+            if (opres <= 0) {
+                res = opres == -1 && errno == EINTR ? 0 : -1;
+                continue;
+            }
+            res = line_index_scan(li, buffer, opres, offset, &k);
+            last = buffer[opres - 1];
+            offset += opres;
+        }
+        release_buffer(buffer, read_ahead_size);
+    }
+    if (res == -1) {
+        line_index_free(li);
+        return NULL;
+    }
+    // the newlines past the last full stride, and an unterminated line
+    li->lines += LINE_INDEX_STRIDE - k;
+    li->lines += last != '\n';
+    return li;
+}
+
+typedef struct file_mode_configure_t
+{
+    uint32_t flags;
+    uint32_t mode;
+} file_mode_configure;
+
+static int32_t mode_to_mask(char *m, file_mode_configure *conf)
+{
+    /*
+            read write create truncate append   pos
+        r     1    0     0       0       0     start
+        w     0    1     1       1       0     start
+        a     0    1     1       0       1     end
+        r+    1    1     0       0       0     start
+        w+    1    1     1       1       0     start
+        a+    1    1     1       0       1     start
+
+        modifiers may follow the base mode.
+        m     map the whole file instead of buffering it. (r, w and a)
+        p     read the next block ahead on a helper thread. (r only)
+        b     write full blocks behind on a helper thread. (w and a only)
+        d     bypass the page cache with direct io. (not with m, p or b)
+        t     text, skip the byte order mark and read foreign endian
+              utf16 and utf32 as native. (r only)
+        s     sparse, read holes without reading them and punch holes
+              for pages of zeros. (not with +, m, p, b or d)
+    */
+    conf->flags = 0; //|= O_SYNC;
+    conf->mode = 0;
+    int32_t update = 0;
+    int32_t mapped = 0;
+    int32_t ahead = 0;
+    int32_t behind = 0;
+    int32_t direct = 0;
+    int32_t text = 0;
+    int32_t sparse = 0;
+    for (char *c = &m[1]; *c != '\0'; c++) {
+        switch (*c) {
+        case '+':
+            update = 1;
+            break;
+        case 'm':
+            mapped = MAPPED;
+            break;
+        case 'p':
+            ahead = READ_AHEAD;
+            break;
+        case 'b':
+            behind = WRITE_BEHIND;
+            break;
+        case 'd':
+            direct = DIRECT;
+            break;
+        case 't':
+            text = TEXT;
+            break;
+        case 's':
+            sparse = SPARSE;
+            break;
+        default:
+            return INVALID;
+        }
+    }
+    if (mapped && (update || behind)) {
+        // a mapping is either read or written through
+        return INVALID;
+    }
+    if (ahead && (mapped || update || m[0] != 'r')) {
+        // reading ahead only makes sense for plain sequential reads
+        return INVALID;
+    }
+    if (behind && (update || m[0] == 'r')) {
+        // and writing behind for plain sequential writes
+        return INVALID;
+    }
+    if (direct && (mapped || ahead || behind)) {
+        return INVALID;
+    }
+    if (text && (update || m[0] != 'r')) {
+        // swapped units would be written back swapped
+        return INVALID;
+    }
+    if (sparse && (update || mapped || ahead || behind || direct)) {
+        // holes are only handled on our own buffered path
+        return INVALID;
+    }
+#if defined(LINUX)
+    if (direct) {
+        conf->flags |= O_DIRECT;
+    }
+#endif
+    switch (m[0]) {
+    case 'r':
+        if (update) {
+            conf->flags |= O_RDWR;
+            conf->mode |= S_IREAD | S_IWRITE;
+            return READ | WRITE | direct;
+        } else {
+            conf->flags |= O_RDONLY;
+            conf->mode |= S_IREAD;
+            return READ | mapped | ahead | direct | text | sparse;
+        }
+    case 'w':
+        if (update) {
+            conf->flags |= O_RDWR | O_CREAT | O_TRUNC;
+            conf->mode |= S_IREAD | S_IWRITE;
+            return READ | WRITE | CREATE | TRUNCATE | direct;
+        } else {
+            conf->flags |= O_RDWR | O_CREAT | O_TRUNC;
+            conf->mode |= S_IWRITE;
+            return WRITE | CREATE | TRUNCATE | behind | direct | mapped |
+                   sparse;
+        }
+    case 'a':
+        if (update) {
+            conf->flags |= O_RDWR | O_CREAT;
+            conf->mode |= S_IREAD | S_IWRITE;
+            return READ | WRITE | CREATE | APPEND | direct;
+        } else {
+            // direct io reads back partial pages, and shared
+            // mappings need a descriptor we can read
+            conf->flags |= ((direct || mapped) ? O_RDWR : O_WRONLY) | O_CREAT;
+            conf->mode |= S_IWRITE;
+            return WRITE | CREATE | APPEND | behind | direct | mapped |
+                   sparse;
+        }
+    default:
+        break;
+    }
+    return INVALID;
+}
+
+static void detect_bom(file_stream *fs)
+{
+    /*
+        Look for a byte order mark at the start of a text stream.
+        The utf32 little endian mark starts with the utf16 one,
+        so it goes first. We read a whole page for direct io.
+    */
+    uint8_t *bom = alloc_buffer(page_size);
+    if (bom == NULL) {
+        return;
+    }
+    ssize_t opres = fs_sys_pread(fs, bom, page_size, 0);
+    if (opres >= 4 && bom[0] == 0xFF && bom[1] == 0xFE && bom[2] == 0 &&
+        bom[3] == 0) {
+        fs->encoding = UNICODE_32;
+        fs->bom_size = 4;
+    } else if (opres >= 4 && bom[0] == 0 && bom[1] == 0 && bom[2] == 0xFE &&
+               bom[3] == 0xFF) {
+        fs->encoding = UNICODE_32;
+        fs->big_endian = 1;
+        fs->bom_size = 4;
+    } else if (opres >= 3 && bom[0] == 0xEF && bom[1] == 0xBB &&
+               bom[2] == 0xBF) {
+        fs->encoding = ASCII;
+        fs->bom_size = 3;
+    } else if (opres >= 2 && bom[0] == 0xFF && bom[1] == 0xFE) {
+        fs->encoding = UNICODE_16;
+        fs->bom_size = 2;
+    } else if (opres >= 2 && bom[0] == 0xFE && bom[1] == 0xFF) {
+        fs->encoding = UNICODE_16;
+        fs->big_endian = 1;
+        fs->bom_size = 2;
+    }
+    release_buffer(bom, page_size);
+    int32_t host_big_endian = __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__;
+    if (fs->encoding != ASCII && fs->bom_size > 0 &&
+        fs->big_endian != host_big_endian) {
+        fs->swap_units = fs->encoding;
+    }
+}
+
+static int32_t map_stream(file_stream *fs)
+{
+    /*
+        Map the whole file as our buffer. The buffer then covers
+        [0, file_size) and the file pointer sits at the end,
+        so the read paths never have to sync with the disk.
+    */
+    fs->buffer = NULL;
+    fs->buffer_size = 0;
+    fs->file_ptr = fs->file_size;
+    if (fs->file_size == 0) {
+        // nothing to map
+        return 0;
+    }
+    void *m = mmap(NULL, fs->file_size, PROT_READ, MAP_PRIVATE, fs->fd, 0);
+    if (m == MAP_FAILED) {
+        fs->file_ptr = 0;
+        return -1;
+    }
+    madvise(m, fs->file_size, MADV_SEQUENTIAL);
+    madvise(m, fs->file_size, MADV_WILLNEED);
+    fs->buffer = (uint8_t *)m;
+    fs->buffer_size = fs->file_size;
+    return 0;
+}
+
+static int32_t map_reserve(file_stream *fs, size_t capacity)
+{
+    /*
+        Reserve the disk space under the mapping up front, so a full
+        disk fails here and not as a SIGBUS on a store into it.
+    */
+#if defined(LINUX)
+    size_t from = fs->buffer_capacity;
+    if (fallocate(fs->fd, 0, from, capacity - from) == 0) {
+        return 0;
+    }
+    if (errno != EOPNOTSUPP && errno != ENOSYS) {
+        return -1;
+    }
+#endif
+    // no reservations here, extend the file sparse
+    struct stat stats;
+    if (fstat(fs->fd, &stats) == -1) {
+        return -1;
+    }
+    if ((size_t)stats.st_size >= capacity) {
+        return 0;
+    }
+    return ftruncate(fs->fd, capacity);
+}
+
+static int32_t map_grow(file_stream *fs, size_t size)
+{
+    /*
+        Make the writable mapping cover [0, size).
+        It grows at least twofold, in whole pages, and in whole map
+        steps once it is that big. A small file stays small, should
+        we die before close_stream cuts it back.
+    */
+    size_t capacity = next_page_multiple(MAX(size, fs->buffer_capacity * 2));
+    if (capacity > map_step_size) {
+        capacity = (capacity + (map_step_size - 1)) & ~(map_step_size - 1);
+    }
+    if (map_reserve(fs, capacity) == -1) {
+        return -1;
+    }
+    void *m = MAP_FAILED;
+    if (fs->buffer == NULL) {
+        m = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fs->fd,
+                 0);
+    } else {
+#if defined(LINUX)
+        m = mremap(fs->buffer, fs->buffer_capacity, capacity, MREMAP_MAYMOVE);
+#else
+        munmap(fs->buffer, fs->buffer_capacity);
+        fs->buffer = NULL;
+        fs->buffer_size = 0;
+        fs->buffer_capacity = 0;
+        m = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fs->fd,
+                 0);
+#endif
+    }
+    if (m == MAP_FAILED) {
+        return -1;
+    }
+#if defined(MADV_POPULATE_WRITE)
+    // fault in the pages about to be written with one call, not one
+    // trap per page
+    size_t from = prev_page_multiple(MIN(fs->buffer_ptr, size));
+    madvise((uint8_t *)m + from, next_page_multiple(size) - from,
+            MADV_POPULATE_WRITE);
+#endif
+    fs->buffer = (uint8_t *)m;
+    fs->buffer_size = capacity;
+    fs->buffer_capacity = capacity;
+    return 0;
+}
+
+static int32_t map_write_stream(file_stream *fs)
+{
+    /*
+        Writes go straight into a shared mapping of the file.
+        buffer[0] is the start of the file, file_ptr stays at 0 and
+        file_size tracks how far we wrote. close_stream cuts the file
+        back to that size.
+    */
+    fs->buffer = NULL;
+    fs->buffer_size = 0;
+    fs->buffer_capacity = 0;
+    fs->file_ptr = 0;
+    fs->buffer_ptr = (fs->mode & APPEND) ? fs->file_size : 0;
+    if (map_grow(fs, fs->file_size + 1) == -1) {
+        int32_t error = errno;
+        if (fs->buffer) {
+            munmap(fs->buffer, fs->buffer_capacity);
+        }
+        // drop what we reserved
+        ftruncate(fs->fd, fs->file_size);
+        fs->buffer_ptr = 0;
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+static file_stream *open_stream(size_t stream_size, const char *p,
+                                char *mode, uint32_t permissions)
+{
+    //
+    // the internal mode flag
+    //
+
+    /*
+        we use the buffer-less file IO. Because we are managing our own buffer.
+        permissions replace what mode gives a file we create, unless 0.
+    */
+    file_mode_configure config;
+    file_stream_mode emode = mode_to_mask(mode, &config);
+    if (emode == INVALID) {
+        return NULL;
+    }
+    if (permissions != 0) {
+        config.mode = permissions;
+    }
+    int32_t fd = open(p, config.flags, config.mode);
+#if defined(LINUX)
+    if (fd == -1 && errno == EINVAL && (emode & DIRECT)) {
+        // the file system does not do direct io, use the page cache
+        fd = open(p, config.flags & ~O_DIRECT, config.mode);
+    }
+    int32_t tail_fd = -1;
+    if (fd != -1 && (emode & WRITE) && (fcntl(fd, F_GETFL) & O_DIRECT)) {
+        // the file exists now, whatever the mode asked to create
+        tail_fd = open(p, O_WRONLY);
+        if (tail_fd == -1) {
+            int32_t error = errno;
+            close(fd);
+            errno = error;
+            return NULL;
+        }
+    }
+#elif defined(F_NOCACHE)
+    if (fd != -1 && (emode & DIRECT)) {
+        fcntl(fd, F_NOCACHE, 1);
+    }
+#endif
+    if (fd == -1) {
+        // Well that did not work out so well.
+        return NULL;
+    }
+
+    // create our stream
+    if (!scan_table.selected) {
+        fs_set_scan_isa(fs_best_scan_isa());
+    }
+    file_stream *new_stream = (file_stream *)malloc(stream_size);
+    new_stream->fd = fd;
+    new_stream->tail_fd = -1;
+#if defined(LINUX)
+    new_stream->tail_fd = tail_fd;
+#endif
+    new_stream->mode = emode;
+    new_stream->buffer_size = alloc_size;
+    new_stream->file_size = page_size;
+    new_stream->buffer_ptr = 0;
+    new_stream->file_ptr = 0;
+    new_stream->buffer_capacity = 0;
+    new_stream->prefetch = NULL;
+    new_stream->flusher = NULL;
+    new_stream->lines = NULL;
+    new_stream->extents = NULL;
+    new_stream->extent_count = 0;
+    new_stream->sink = NULL;
+    stream_touch(new_stream);
+    new_stream->checksum = 0;
+    new_stream->crc = 0;
+    new_stream->digest_from = 0;
+    new_stream->digest_end = 0;
+    new_stream->advice = ADVISE_NORMAL;
+    new_stream->os_advice = ADVISE_NORMAL;
+    new_stream->buffer_limit = buffer_limit_size;
+    new_stream->sequential = 0;
+    new_stream->random = 0;
+    new_stream->encoding = 0;
+    new_stream->big_endian = 0;
+    new_stream->bom_size = 0;
+    new_stream->swap_units = 0;
+#if defined(CSTREAM_STATS)
+    memset(&new_stream->stats, 0, sizeof(fs_stats));
+#endif
+
+    struct stat stats;
+    if (fstat(fd, &stats) == 0) {
+        new_stream->file_size = stats.st_size;
+        if ((new_stream->file_size > 0) &&
+            (new_stream->file_size < new_stream->buffer_size)) {
+            new_stream->buffer_size = new_stream->file_size;
+        }
+    } else {
+        // we need a known size to map or read ahead
+        new_stream->mode &= ~(MAPPED | READ_AHEAD);
+    }
+    if (new_stream->file_size <= alloc_size) {
+        // a single buffer covers it, nothing to read ahead
+        new_stream->mode &= ~READ_AHEAD;
+    }
+    if ((new_stream->mode & (SPARSE | READ)) == (SPARSE | READ)) {
+        extents_map(new_stream);
+    }
+    if (new_stream->mode & TEXT) {
+        detect_bom(new_stream);
+        if (new_stream->swap_units) {
+            // we can not swap a read only mapping in place
+            new_stream->mode &= ~MAPPED;
+        }
+    }
+
+    if (new_stream->mode & MAPPED) {
+        int32_t res = (new_stream->mode & WRITE) ? map_write_stream(new_stream)
+                                                 : map_stream(new_stream);
+        if (res == 0) {
+            return new_stream;
+        }
+        // not mappable, fall back to our own buffer
+        new_stream->mode &= ~MAPPED;
+        new_stream->buffer_size = alloc_size;
+        if ((new_stream->file_size > 0) &&
+            (new_stream->file_size < new_stream->buffer_size)) {
+            new_stream->buffer_size = new_stream->file_size;
+        }
+    }
+    if (new_stream->mode & READ_AHEAD) {
+        if (prefetch_open(new_stream) == 0) {
+            return new_stream;
+        }
+        new_stream->mode &= ~READ_AHEAD;
+    }
+    if (new_stream->mode & WRITE_BEHIND) {
+        if (flusher_open(new_stream) == 0) {
+            return new_stream;
+        }
+        new_stream->mode &= ~WRITE_BEHIND;
+    }
+    // allocate whole pages, direct io reads past a short tail
+    new_stream->buffer_capacity = next_page_multiple(new_stream->buffer_size);
+    new_stream->buffer = alloc_buffer(new_stream->buffer_capacity);
+
+    return new_stream;
+}
+
+static file_stream *create_stream(size_t stream_size, const char *p,
+                                  char *mode)
+{
+    return open_stream(stream_size, p, mode, 0);
+}
+
+file_stream *fs_open(const char *p, char *mode)
+{
+    /*
+        Create a file streaming object
+    */
+    file_stream *fs = create_stream(sizeof(file_stream), p, mode);
+    if (fs && fs->bom_size > 0) {
+        // text streams start past their byte order mark
+        fs_seek(fs, fs->bom_size, SEEK_SET);
+    }
+    return fs;
+}
+
+int32_t close_stream(file_stream *stream)
+{
+    /*
+        Returns -1 with errno set when pending writes failed.
+    */
+    int32_t res = 0;
+    // release our buffer and file descriptor
+    if (stream) {
+        if (stream->sink) {
+            sink_release(stream);
+        }
+        res = fs_flush(stream);
+        int32_t error = errno;
+        // release our heap stores
+        if (stream->mode & MAPPED) {
+            if (stream->buffer) {
+                munmap(stream->buffer, stream->buffer_size);
+            }
+            if ((stream->mode & WRITE) &&
+                ftruncate(stream->fd, stream->file_size) == -1 && res == 0) {
+                res = -1;
+                error = errno;
+            }
+        } else if (stream->mode & READ_AHEAD) {
+            prefetch_close(stream);
+        } else if (stream->mode & WRITE_BEHIND) {
+            flusher_close(stream);
+        } else {
+            release_buffer(stream->buffer, stream->buffer_capacity);
+        }
+        line_index_free(stream->lines);
+        free(stream->extents);
+        if (close(stream->fd) == -1 && res == 0) {
+            res = -1;
+            error = errno;
+        }
+        if (stream->tail_fd != -1) {
+            close(stream->tail_fd);
+        }
+        free(stream);
+        errno = error;
+    }
+    return res;
+}
+
+static size_t resize_buffer(file_stream *fs, size_t sm)
+{
+    /*
+        we compute the span of the buffers range in
+        os page sizes.
+
+        When a size request reaches passed the current end of
+        the buffer, we need to see if the size requested and
+        the current page we are in will fit into our current buffer.
+
+        Because to avoid needless copies, we just re-read
+        the current page, but set the start of our buffer
+        as that last page. Then we read in the remaining request,
+        rounded up to the next os page size.
+
+    */
+    size_t head = prev_page_multiple(fs->buffer_ptr);
+    size_t tail = next_page_multiple(sm + fs->buffer_ptr);
+    size_t span = tail - head;
+    size_t start_offset = fs->buffer_ptr - head;
+
+    // if we need more space for our buffer
+    if (span > fs->buffer_capacity) {
+        // grow geometrically so long requests do not re-read
+        // their head over and over.
+        span = MAX(span, fs->buffer_capacity * 2);
+        stats_add(fs, reallocs, 1);
+        release_buffer(fs->buffer, fs->buffer_capacity);
+        fs->buffer = alloc_buffer(span);
+        fs->buffer_capacity = span;
+    }
+    fs->buffer_size = fs->buffer_capacity;
+
+    // do we need to rewind, because we are streaming
+    // passed the end.
+    if (head != fs->file_ptr) {
+        // rewind to our last page multiple
+        stats_add(fs, rewinds, 1);
+        if (head < fs->file_ptr) {
+            stats_add(fs, reread_bytes, fs->file_ptr - head);
+        }
+        fs_sys_lseek(fs, head, SEEK_SET);
+        fs->file_ptr = head;
+    }
+    return start_offset;
+}
+
+static size_t sync_stream_read(file_stream *fs, size_t sm)
+{
+    /*
+        Sync the stream and the internal buffer.
+        After a successfull sync the buffer holds
+        [buffer_ptr, buffer_ptr + sm), or up to the end of the file.
+    */
+    if (fs->sink) {
+        sink_release(fs);
+    }
+    if (fs->mode & READ_AHEAD) {
+        return prefetch_stream_read(fs, sm);
+    }
+    if (fs->file_ptr == fs->file_size) {
+        return 0;
+    }
+    ssize_t opres = 0;
+    adapt_fill(fs);
+
+    if ((fs->buffer_ptr != fs->file_ptr) || (sm > fs->buffer_capacity)) {
+        /*
+            We still have data left in our current buffer,
+            or the request is larger than the buffer.
+        */
+        resize_buffer(fs, sm);
+    }
+    /*
+        Otherwise the fast path when you are streaming fixed sizes
+    */
+    size_t next_size = fs->buffer_capacity;
+    if ((fs->file_ptr + next_size) > fs->file_size) {
+        next_size = fs->file_size - fs->file_ptr;
+    }
+    if (fs->mode & DIRECT) {
+        // a whole page request, the read comes back short at the tail
+        next_size = next_page_multiple(next_size);
+    }
+    // stream the next batch
+    if ((opres = fill_read(fs, fs->file_ptr, next_size)) <= 0) {
+        return 0;
+    }
+    checksum_update(fs, fs->file_ptr, fs->buffer, opres);
+    text_swap(fs, fs->buffer, fs->file_ptr, opres);
+
+    fs->buffer_size = opres;
+    fs->file_ptr += opres;
+
+    return opres;
+}
+
+static size_t sync_stream_write(file_stream *fs, size_t sm)
+{
+    /*
+        Sync the stream and the internal buffer.
+    */
+    if (fs->sink) {
+        sink_release(fs);
+    }
+    if (fs->mode & WRITE_BEHIND) {
+        return behind_stream_write(fs, sm);
+    }
+    if (fs->mode & MAPPED) {
+        if (map_grow(fs, fs->buffer_ptr + sm) == -1) {
+            return 0;
+        }
+        return fs->buffer_size;
+    }
+
+    // flush our buffer
+    if (fs->mode & DIRECT) {
+        // the partial page stays with us until it fills up
+        if (flush_direct(fs, 0) == -1) {
+            return 0;
+        }
+    } else if (fs_flush(fs) == -1) {
+        return 0;
+    }
+    size_t pending = fs->buffer_ptr - fs->file_ptr;
+    if ((sm + pending) > fs->buffer_size) {
+        /*
+            A rare case where the size is larger then the buffer.
+        */
+        size_t span = next_page_multiple(sm + pending);
+        uint8_t *buffer = alloc_buffer(span);
+        memcpy(buffer, fs->buffer, pending);
+        release_buffer(fs->buffer, fs->buffer_capacity);
+        fs->buffer = buffer;
+        fs->buffer_size = span;
+        fs->buffer_capacity = span;
+    }
+
+    return fs->buffer_size;
+}
+/*
+
+*/
+// unit test branch labels.
+uint8_t *fs_read(file_stream *fs, size_t desired, size_t *result)
+{
+    /*
+        This acts more as an allocator then a copy based data stream.
+        Hand you a pointer to the start of your data.
+    */
+    uint8_t *res = NULL;
+    *result = desired;
+    if ((desired + fs->buffer_ptr) > fs->file_ptr) {
+        /*
+            Our buffer has reached its very end.
+        */
+        if (fs->file_ptr != fs->file_size) {
+            sync_stream_read(fs, desired);
+        }
+        if ((desired + fs->buffer_ptr) > fs->file_ptr) {
+            // We have nothing yet to read from the actual file on disk.
+            // if there is something left to be fetched form the buffer
+            // we correct the desired size.
+            size_t rem_size = fs->file_ptr - fs->buffer_ptr;
+            *result = rem_size;
+            if (rem_size == 0) {
+                // well, we are completely empty
+                return 0;
+            }
+        }
+    }
+
+    // otherwise, jsut grab the value from the buffer
+    res = &fs->buffer[(fs->buffer_ptr + fs->buffer_size) - fs->file_ptr];
+    fs->buffer_ptr += *result;
+    return res;
+}
+
+uint8_t *fs_write(file_stream *fs, size_t sm)
+{
+    /*
+        This acts more as an allocator then a copy based data stream.
+        Hand you a pointer to the start of your data.
+    */
+    if ((sm + fs->buffer_ptr) > (fs->file_ptr + fs->buffer_size)) {
+        /*
+            Our buffer has reached its very end.
+        */
+        if (sync_stream_write(fs, sm) == 0) {
+            return 0;
+        }
+    }
+
+    // otherwise, jsut grab the value from the buffer
+    uint8_t *res = &fs->buffer[fs->buffer_ptr - fs->file_ptr];
+    fs->buffer_ptr += sm;
+    return res;
+}
+
+declare_delim(fs_read_line_8, 1, scan_eol_8);
+declare_delim(fs_read_line_16, 2, scan_eol_16);
+declare_delim(fs_read_line_32, 4, scan_eol_32);
+size_t fs_read_line(file_stream *fs, uint8_t **line_start, file_stream_type st)
+{
+    switch (st) {
+    case ASCII: {
+        return fs_read_line_8(fs, line_start, 1);
+    }
+    case UNICODE_16: {
+        return fs_read_line_16(fs, line_start, 1);
+    }
+    default: {
+        return fs_read_line_32(fs, line_start, 1);
+    }
+    }
+}
+
+declare_delim(fs_get_delim_8, 1, scan_char_8);
+declare_delim(fs_get_delim_16, 2, scan_char_16);
+declare_delim(fs_get_delim_32, 4, scan_char_32);
+size_t fs_get_delim(file_stream *fs, uint8_t **line_start, int32_t delim,
+                    file_stream_type st)
+{
+    switch (st) {
+    case ASCII: {
+        return fs_get_delim_8(fs, line_start, delim);
+    }
+    case UNICODE_16: {
+        return fs_get_delim_16(fs, line_start, delim);
+    }
+    default: {
+        return fs_get_delim_32(fs, line_start, delim);
+    }
+    }
+}
+
+int64_t fs_tell(file_stream *fs) { return fs->buffer_ptr; }
+
+/*
+    Line index sidecars.
+*/
+static size_t put_varint(uint8_t *out, uint64_t v)
+{
+    size_t i = 0;
+    while (v >= 0x80) {
+        out[i++] = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    out[i++] = (uint8_t)v;
+    return i;
+}
+
+static size_t get_varint(const uint8_t *in, size_t n, uint64_t *v)
+{
+    // returns 0 for a cut or overlong varint
+    *v = 0;
+    for (size_t i = 0; i < n && i < 10; i++) {
+        *v |= (uint64_t)(in[i] & 0x7F) << (7 * i);
+        if (!(in[i] & 0x80)) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+static int32_t line_index_save(fs_line_index *li, const char *p)
+{
+    /*
+        Write the sidecar next to a temporary name and move it into
+        place, so readers never see half of one. Every writer gets a
+        name of its own, p.idx.XXXXXX.
+    */
+    size_t len = strlen(p);
+    char *path = (char *)malloc(len * 2 + 24);
+    if (path == NULL) {
+        return -1;
+    }
+    char *tmp = &path[len + 5];
+    memcpy(path, p, len);
+    memcpy(&path[len], ".idx", 5);
+    memcpy(tmp, path, len + 4);
+    memcpy(&tmp[len + 4], ".XXXXXX", 8);
+    size_t size = sizeof(fs_line_header) + li->count * 10;
+    uint8_t *data = (uint8_t *)malloc(size);
+    int32_t res = -1;
+    if (data) {
+        fs_line_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, line_index_magic, sizeof(header.magic));
+        header.stride = LINE_INDEX_STRIDE;
+        header.file_size = li->file_size;
+        header.mtime_sec = li->mtime_sec;
+        header.mtime_nsec = li->mtime_nsec;
+        header.lines = li->lines;
+        header.count = li->count;
+        memcpy(data, &header, sizeof(header));
+        size_t used = sizeof(header);
+        uint64_t prev = 0;
+        for (uint64_t i = 0; i < li->count; i++) {
+            used += put_varint(&data[used], li->offsets[i] - prev);
+            prev = li->offsets[i];
+        }
+        int32_t fd = mkstemp(tmp);
+        if (fd != -1) {
+            // mkstemp leaves it to us alone, and loads read it
+            fchmod(fd, SHARED_FILE_MODE);
+            size_t done = 0;
+            while (done < used) {
+                ssize_t opres = write(fd, &data[done], used - done);
+                if (opres == -1 && errno == EINTR) {
+                    continue;
+                }
+                if (opres <= 0) {
+                    break;
+                }
+                done += opres;
+            }
+            res = (close(fd) == 0 && done == used) ? 0 : -1;
+            if (res == 0) {
+                res = rename(tmp, path);
+            }
+            if (res == -1) {
+                unlink(tmp);
+            }
+        }
+        free(data);
+    }
+    free(path);
+    return res;
+}
+
+static fs_line_index *line_index_load(const char *p, struct stat *stats)
+{
+    /*
+        Load the sidecar when it still describes the file.
+    */
+    size_t len = strlen(p);
+    char *path = (char *)malloc(len + 5);
+    if (path == NULL) {
+        return NULL;
+    }
+    memcpy(path, p, len);
+    memcpy(&path[len], ".idx", 5);
+    file_stream *in = fs_open(path, "rm");
+    free(path);
+    if (in == NULL) {
+        return NULL;
+    }
+    fs_line_index *li = NULL;
+    fs_line_header header;
+    int64_t mtime_sec = 0;
+    int64_t mtime_nsec = 0;
+    stat_mtime(stats, &mtime_sec, &mtime_nsec);
+    size_t got = 0;
+    uint8_t *data = fs_read(in, sizeof(header), &got);
+    if (data && got == sizeof(header)) {
+        memcpy(&header, data, sizeof(header));
+    }
+    if (got == sizeof(header) &&
+        memcmp(header.magic, line_index_magic, sizeof(header.magic)) == 0 &&
+        header.stride == LINE_INDEX_STRIDE &&
+        header.file_size == (uint64_t)stats->st_size &&
+        header.mtime_sec == mtime_sec && header.mtime_nsec == mtime_nsec) {
+        li = line_index_new(stats);
+        size_t size = in->file_size - sizeof(header);
+        data = fs_read(in, size, &got);
+        uint64_t prev = 0;
+        for (size_t used = 0; li && data && used < got;) {
+            uint64_t delta = 0;
+            size_t n = get_varint(&data[used], got - used, &delta);
+            if (n == 0 || line_index_push(li, prev + delta) == -1) {
+                break;
+            }
+            prev += delta;
+            used += n;
+        }
+        if (li && li->count != header.count) {
+            // a damaged sidecar, we rebuild it
+            line_index_free(li);
+            li = NULL;
+        } else if (li) {
+            li->lines = header.lines;
+        }
+    }
+    close_stream(in);
+    return li;
+}
+
+int32_t fs_index_lines(file_stream *fs, const char *p)
+{
+    /*
+        Attach the line index of p, the file fs reads.
+        A fresh sidecar is loaded, otherwise the index is built and
+        saved for next time. Without p the index stays in memory.
+    */
+    struct stat stats;
+    if (fstat(fs->fd, &stats) == -1) {
+        return -1;
+    }
+    fs_line_index *li = p ? line_index_load(p, &stats) : NULL;
+    if (li == NULL) {
+        li = line_index_build(fs->fd, &stats);
+        if (li == NULL) {
+            return -1;
+        }
+        if (p) {
+            // we can live without the sidecar
+            line_index_save(li, p);
+        }
+    }
+    line_index_free(fs->lines);
+    fs->lines = li;
+    return 0;
+}
+
+int64_t fs_seek_line(file_stream *fs, uint64_t line)
+{
+    /*
+        Move to the start of a line, counted from 0.
+        Returns its offset, or -1 past the last line.
+        Lines here end with '\n' only, and empty ones count. That is
+        not what fs_read_line returns, it also splits on '\r', '\0',
+        VT, FF and 0x05 and skips empty lines.
+    */
+    if ((fs->mode & WRITE) || (fs->lines == NULL &&
+                               fs_index_lines(fs, NULL) == -1)) {
+        return -1;
+    }
+    fs_line_index *li = fs->lines;
+    if (line >= li->lines) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (fs_seek(fs, li->offsets[line / LINE_INDEX_STRIDE], SEEK_SET) == -1) {
+        return -1;
+    }
+    size_t k = line % LINE_INDEX_STRIDE;
+    while (k > 0) {
+        // walk the last few lines in our own buffer
+        size_t avail = fs->file_ptr - fs->buffer_ptr;
+        size_t got = 0;
+        uint8_t *p = fs_read(fs, MAX(avail, 1), &got);
+        if (p == NULL) {
+            return -1;
+        }
+        size_t used = scan_table.nth_8(p, got, '\n', &k);
+        fs->buffer_ptr -= got - used;
+    }
+    return fs->buffer_ptr;
+}
+
+/*
+    Positional reads and writes.
+    They never touch the cursor or the buffer of the stream, so any
+    number of threads can use one stream at once, without locks.
+    Reads land in a reader, which keeps the pages it read until the
+    stream writes again. Pass NULL to use the reader of the calling
+    thread. Writes through other descriptors are not tracked.
+*/
+typedef struct fs_reader_t
+{
+    uint8_t *buffer;
+    size_t capacity;
+    // the file range we hold, and the stream state it came from
+    size_t offset;
+    size_t size;
+    uint64_t generation;
+} fs_reader;
+
+int32_t fs_reader_init(fs_reader *r, size_t capacity)
+{
+    r->capacity = next_page_multiple(MAX(capacity, 1));
+    r->buffer = alloc_buffer(r->capacity);
+    r->offset = 0;
+    r->size = 0;
+    r->generation = 0;
+    return r->buffer ? 0 : -1;
+}
+
+void fs_reader_release(fs_reader *r)
+{
+    release_buffer(r->buffer, r->capacity);
+    r->buffer = NULL;
+    r->capacity = 0;
+    r->generation = 0;
+}
+
+static pthread_key_t reader_key;
+static pthread_once_t reader_once = PTHREAD_ONCE_INIT;
+
+static void reader_destroy(void *arg)
+{
+    fs_reader_release((fs_reader *)arg);
+    free(arg);
+}
+
+static void reader_key_init()
+{
+    pthread_key_create(&reader_key, reader_destroy);
+}
+
+static fs_reader *thread_reader()
+{
+    pthread_once(&reader_once, reader_key_init);
+    fs_reader *r = (fs_reader *)pthread_getspecific(reader_key);
+    if (r == NULL) {
+        r = (fs_reader *)malloc(sizeof(fs_reader));
+        if (r == NULL || fs_reader_init(r, reader_size) == -1) {
+            free(r);
+            return NULL;
+        }
+        pthread_setspecific(reader_key, r);
+    }
+    return r;
+}
+
+uint8_t *fs_pread(file_stream *fs, fs_reader *r, size_t offset,
+                  size_t desired, size_t *result)
+{
+    /*
+        Hand out [offset, offset + desired) of the file,
+        result is set to how much of it there is.
+    */
+    *result = 0;
+    if ((fs->mode & (MAPPED | WRITE)) == MAPPED) {
+        if (offset >= fs->file_size) {
+            return NULL;
+        }
+        *result = MIN(desired, fs->file_size - offset);
+        return &fs->buffer[offset];
+    }
+    if (r == NULL && (r = thread_reader()) == NULL) {
+        return NULL;
+    }
+    // read the generation first, a write after it invalidates our read
+    uint64_t gen = __atomic_load_n(&fs->generation, __ATOMIC_ACQUIRE);
+    if (r->generation != gen || offset < r->offset ||
+        (offset + desired) > (r->offset + r->size)) {
+        /*
+            Read whole pages around the request,
+            as many as the reader holds.
+        */
+        size_t head = prev_page_multiple(offset);
+        size_t span = next_page_multiple(offset + desired) - head;
+        if (span > r->capacity) {
+            fs_reader_release(r);
+            if (fs_reader_init(r, span) == -1) {
+                return NULL;
+            }
+        }
+        r->generation = 0;
+        size_t size = 0;
+        while (size < r->capacity) {
+            ssize_t opres = fs_sys_pread(fs, &r->buffer[size],
+                                         r->capacity - size, head + size);
+            if (opres == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return NULL;
+            }
+            if (opres == 0 || (head + size + opres) >= (offset + desired)) {
+                size += opres;
+                break;
+            }
+            size += opres;
+        }
+        r->offset = head;
+        r->size = size;
+        r->generation = gen;
+    }
+    if (offset >= r->offset + r->size) {
+        return NULL;
+    }
+    *result = MIN(desired, r->offset + r->size - offset);
+    return &r->buffer[offset - r->offset];
+}
+
+int32_t fs_pwrite(file_stream *fs, size_t offset, const uint8_t *data,
+                  size_t size)
+{
+    /*
+        Write size bytes at offset. Direct io streams need the
+        offset, size and data on page boundaries.
+    */
+    if (!(fs->mode & WRITE)) {
+        errno = EBADF;
+        return -1;
+    }
+    if (fs->mode & MAPPED) {
+        // so close_stream keeps it
+        store_max(&fs->file_size, offset + size);
+    }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t opres =
+            fs_sys_pwrite(fs, &data[done], size - done, offset + done);
+        if (opres == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += opres;
+    }
+    return 0;
+}
+
+/*
+    Checksums.
+    fs_checksum starts a crc32c of the stream at its cursor. Reads fold
+    in every block as it is filled and writes every block as it is
+    flushed, so the bytes are checksummed while they are still in cache
+    and not in a second pass. Blocks that are read again are skipped.
+    A read that skips ahead stops the checksum, and a write that goes
+    back over it voids it. Mapped readers fold in what their cursor
+    has moved past when asked. fs_pread and fs_pwrite bypass it.
+*/
+int32_t fs_checksum(file_stream *fs)
+{
+    if (fs_flush(fs) == -1) {
+        return -1;
+    }
+    pthread_once(&crc32c_once, crc32c_table_init);
+    fs->checksum = 1;
+    fs->crc = ~0u;
+    fs->digest_from = fs->buffer_ptr;
+    fs->digest_end = fs->buffer_ptr;
+    if (!(fs->mode & (WRITE | MAPPED)) && fs->file_ptr > fs->buffer_ptr) {
+        // what the buffer holds already
+        size_t at = fs->buffer_ptr;
+        size_t idx = (at + fs->buffer_size) - fs->file_ptr;
+        size_t mask = fs->swap_units ? fs->swap_units - 1 : 0;
+        if (at & mask) {
+            // the unit we start in is swapped, take its bytes from the file
+            uint8_t unit[4];
+            size_t part = MIN((mask + 1) - (at & mask), fs->file_ptr - at);
+            if (fs_sys_pread(fs, unit, part, at) != (ssize_t)part) {
+                // stopped before it started
+                fs->checksum = -1;
+                return 0;
+            }
+            checksum_update(fs, at, unit, part);
+            at += part;
+            idx += part;
+        }
+        checksum_fill(fs, at, &fs->buffer[idx], fs->file_ptr - at);
+    }
+    return 0;
+}
+
+uint32_t fs_digest(file_stream *fs, size_t *size)
+{
+    /*
+        The crc32c so far, size is set to how many bytes it covers.
+        A writer is flushed first, so it covers all that was written.
+    */
+    *size = 0;
+    if (fs->checksum == 0) {
+        return 0;
+    }
+    if (fs->mode & WRITE) {
+        fs_flush(fs);
+    } else if ((fs->mode & MAPPED) && fs->buffer_ptr > fs->digest_end) {
+        checksum_update(fs, fs->digest_end, &fs->buffer[fs->digest_end],
+                        fs->buffer_ptr - fs->digest_end);
+    }
+    *size = fs->digest_end - fs->digest_from;
+    return ~fs->crc;
+}
+
+/*
+    Stream to stream copies.
+    fs_copy moves bytes from the cursor of src to the cursor of dst.
+    Pending writes of dst are flushed first. The copy works on file
+    offsets, so what src holds in its buffer past the cursor is simply
+    copied again from the file, and src refills on its next read.
+    On linux the bytes stay in the kernel, with copy_file_range, or
+    sendfile where the two files can not do that. Streams that change
+    bytes on the way in or checksum them, and everything else, go
+    through our buffers.
+*/
+static int64_t copy_user(file_stream *dst, file_stream *src, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        size_t got = 0;
+        uint8_t *in = fs_read(src, MIN(len - done, alloc_size), &got);
+        if (in == NULL) {
+            break;
+        }
+        uint8_t *out = fs_write(dst, got);
+        if (out == NULL) {
+            return done > 0 ? (int64_t)done : -1;
+        }
+        memcpy(out, in, got);
+        done += got;
+    }
+    return done;
+}
+
+#if defined(LINUX)
+static void read_skip(file_stream *fs, size_t target)
+{
+    if (target <= fs->file_ptr) {
+        // still within our buffer
+        fs->buffer_ptr = target;
+        return;
+    }
+    if ((fs->mode & (DIRECT | READ_AHEAD | MAPPED)) ||
+        fs_sys_lseek(fs, target, SEEK_SET) == -1) {
+        fs_seek(fs, target, SEEK_SET);
+        return;
+    }
+    // an empty buffer, the next read fills it from target
+    fs->buffer_ptr = target;
+    fs->file_ptr = target;
+    fs->buffer_size = 0;
+}
+
+static int32_t copy_unsupported(int32_t error)
+{
+    // the files, not the copy, are the problem
+    return error == EXDEV || error == EINVAL || error == ENOSYS ||
+           error == EOPNOTSUPP;
+}
+
+static size_t copy_kernel(file_stream *dst, file_stream *src, size_t len,
+                          int32_t *error)
+{
+    /*
+        Copy at the two cursors. Returns what was copied, error is
+        set when the kernel stopped before len or the end of src.
+    */
+    loff_t in = src->buffer_ptr;
+    loff_t out = dst->buffer_ptr;
+    off_t offset = 0;
+    int32_t use_sendfile = 0;
+    size_t done = 0;
+    *error = 0;
+    while (done < len) {
+        size_t n = MIN(len - done, copy_step_size);
+        ssize_t opres = 0;
+        if (!use_sendfile) {
+            opres = copy_file_range(src->fd, &in, dst->fd, &out, n, 0);
+        } else if ((opres = sendfile(dst->fd, src->fd, &in, n)) > 0) {
+            out += opres;
+        }
+        if (opres == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (!use_sendfile && done == 0 && copy_unsupported(errno) &&
+                (offset = lseek(dst->fd, 0, SEEK_CUR)) != -1 &&
+                lseek(dst->fd, out, SEEK_SET) != -1) {
+                // sendfile writes at the descriptor offset
+                use_sendfile = 1;
+                continue;
+            }
+            *error = errno;
+            break;
+        }
+        if (opres == 0) {
+            break;
+        }
+        done += opres;
+    }
+    if (use_sendfile && done == 0) {
+        // our buffered path writes at the old offset
+        lseek(dst->fd, offset, SEEK_SET);
+    }
+    return done;
+}
+#endif
+
+int64_t fs_copy(file_stream *dst, file_stream *src, size_t len)
+{
+    /*
+        Copy up to len bytes, fewer when src ends first.
+        Returns how many, or -1 with errno set when none were.
+    */
+    if (!(dst->mode & WRITE) || !(src->mode & READ)) {
+        errno = EBADF;
+        return -1;
+    }
+    if (fs_flush(dst) == -1 || fs_flush(src) == -1) {
+        return -1;
+    }
+    if (!(src->mode & WRITE)) {
+        len = MIN(len, src->file_size - MIN(src->buffer_ptr, src->file_size));
+    }
+    if (len == 0) {
+        return 0;
+    }
+#if defined(LINUX)
+    if (!src->swap_units && src->checksum != 1 && dst->checksum != 1) {
+        int32_t error = 0;
+        size_t from = src->buffer_ptr;
+        size_t to = dst->buffer_ptr;
+        size_t done = copy_kernel(dst, src, len, &error);
+        if (done > 0) {
+            read_skip(src, from + done);
+            if (dst->mode & MAPPED) {
+                store_max(&dst->file_size, to + done);
+            }
+            fs_seek(dst, to + done, SEEK_SET);
+            stream_touch(dst);
+        }
+        if (done > 0 || !copy_unsupported(error)) {
+            if (error != 0 && done == 0) {
+                errno = error;
+                return -1;
+            }
+            return done;
+        }
+    }
+#endif
+    return copy_user(dst, src, len);
+}
+
+/*
+    Sinks.
+    A sink forwards spans to a pipe or a socket without copying them
+    into a buffer of its own. Spans of a stream buffer are gathered as
+    they are and go out with one writev per batch, or vmsplice when they
+    are pages of a mapped reader. The stream sends them before it moves
+    its buffer. A span of at least splice_min_size from a reader is kept
+    as a file range instead, and the kernel moves it straight from the
+    file, with splice into a pipe and sendfile elsewhere. Those send the
+    bytes of the file, not changes made to them in the buffer. Spans
+    that follow each other merge into one. Memory of your own has to
+    stay valid until fs_sink_flush. Spans go out in order, when the
+    batch is full and on fs_sink_flush, which has to come before the
+    sink or its streams go away. The sink descriptor has to block.
+*/
+#define SINK_SPANS 256
+// below this a copy into the pipe is cheaper than splicing
+const static uint64_t splice_min_size = page_size * 4;
+
+typedef struct sink_span_t
+{
+    // memory, or a file range of source when base is NULL.
+    // memory with a source is in the buffer of it.
+    const uint8_t *base;
+    file_stream *source;
+    size_t offset;
+    size_t size;
+} sink_span;
+
+typedef struct fs_sink_t
+{
+    int32_t fd;
+    // splice and vmsplice only write into pipes
+    int32_t pipe;
+    sink_span spans[SINK_SPANS];
+    uint32_t count;
+    // a send on behalf of a stream failed, we report it next
+    int32_t error;
+} fs_sink;
+
+int32_t fs_sink_init(fs_sink *k, int32_t fd)
+{
+    struct stat stats;
+    if (fstat(fd, &stats) == -1) {
+        return -1;
+    }
+    k->fd = fd;
+    k->pipe = S_ISFIFO(stats.st_mode);
+    k->count = 0;
+    k->error = 0;
+    return 0;
+}
+
+static int32_t sink_memory(fs_sink *k, uint32_t from, uint32_t to)
+{
+    /*
+        Send the memory spans [from, to) as one vector.
+    */
+    struct iovec iov[SINK_SPANS];
+    uint32_t n = 0;
+    int32_t stable = k->pipe;
+    for (uint32_t i = from; i < to; i++) {
+        file_stream *fs = k->spans[i].source;
+        iov[n].iov_base = (void *)k->spans[i].base;
+        iov[n++].iov_len = k->spans[i].size;
+        stable &= fs != NULL && (fs->mode & (MAPPED | WRITE)) == MAPPED;
+    }
+    uint32_t first = 0;
+    while (first < n) {
+#if defined(LINUX)
+        ssize_t opres = stable ? vmsplice(k->fd, &iov[first], n - first, 0)
+                               : writev(k->fd, &iov[first], n - first);
+#else
+        ssize_t opres = writev(k->fd, &iov[first], n - first);
+#endif
+        if (opres == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        // skip what went out
+        while (first < n && (size_t)opres >= iov[first].iov_len) {
+            opres -= iov[first++].iov_len;
+        }
+        if (first < n) {
+            iov[first].iov_base = (uint8_t *)iov[first].iov_base + opres;
+            iov[first].iov_len -= opres;
+        }
+    }
+    return 0;
+}
+
+static int32_t sink_file(fs_sink *k, sink_span *span)
+{
+    /*
+        Send a file range, through our reader when the
+        kernel can not move it for us.
+    */
+    size_t done = 0;
+#if defined(LINUX)
+    loff_t in = span->offset;
+    off_t offset = span->offset;
+    while (done < span->size) {
+        size_t n = MIN(span->size - done, copy_step_size);
+        ssize_t opres =
+            k->pipe ? splice(span->source->fd, &in, k->fd, NULL, n,
+                             SPLICE_F_MORE)
+                    : sendfile(k->fd, span->source->fd, &offset, n);
+        if (opres == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (copy_unsupported(errno)) {
+                break;
+            }
+            return -1;
+        }
+        if (opres == 0) {
+            // the file got shorter than the span
+            errno = EIO;
+            return -1;
+        }
+        done += opres;
+    }
+#endif
+    while (done < span->size) {
+        size_t got = 0;
+        errno = 0;
+        uint8_t *p = fs_pread(span->source, NULL, span->offset + done,
+                              MIN(span->size - done, reader_size), &got);
+        if (p == NULL) {
+            errno = errno ? errno : EIO;
+            return -1;
+        }
+        size_t sent = 0;
+        while (sent < got) {
+            ssize_t opres = write(k->fd, &p[sent], got - sent);
+            if (opres == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            sent += opres;
+        }
+        done += got;
+    }
+    return 0;
+}
+
+int32_t fs_sink_flush(fs_sink *k)
+{
+    /*
+        Send every span in the batch, in order.
+        Returns -1 with errno set when the sink or a file failed,
+        now or while a stream made us send early.
+        The batch is dropped either way.
+    */
+    int32_t res = 0;
+    uint32_t i = 0;
+    while (i < k->count && res == 0) {
+        if (k->spans[i].base == NULL) {
+            res = sink_file(k, &k->spans[i++]);
+            continue;
+        }
+        uint32_t j = i;
+        while (j < k->count && k->spans[j].base != NULL) {
+            j++;
+        }
+        res = sink_memory(k, i, j);
+        i = j;
+    }
+    for (i = 0; i < k->count; i++) {
+        // file ranges never registered, and a source may be with
+        // another sink by now
+        sink_span *span = &k->spans[i];
+        if (span->base != NULL && span->source && span->source->sink == k) {
+            span->source->sink = NULL;
+        }
+    }
+    k->count = 0;
+    if (res == 0 && k->error) {
+        errno = k->error;
+        res = -1;
+    }
+    k->error = 0;
+    return res;
+}
+
+static void sink_release(file_stream *fs)
+{
+    // the buffer is about to move, send what points into it
+    fs_sink *k = fs->sink;
+    if (fs_sink_flush(k) == -1) {
+        k->error = errno;
+    }
+}
+
+static int32_t sink_push(fs_sink *k, const uint8_t *base, file_stream *source,
+                         size_t offset, size_t size)
+{
+    if (size == 0) {
+        return 0;
+    }
+    if (k->count > 0) {
+        sink_span *last = &k->spans[k->count - 1];
+        int32_t joins =
+            base == NULL
+                ? (last->base == NULL && last->offset + last->size == offset)
+                : (last->base != NULL && last->base + last->size == base);
+        if (joins && last->source == source) {
+            last->size += size;
+            return 0;
+        }
+    }
+    if (k->count == SINK_SPANS && fs_sink_flush(k) == -1) {
+        return -1;
+    }
+    sink_span *span = &k->spans[k->count++];
+    span->base = base;
+    span->source = source;
+    span->offset = offset;
+    span->size = size;
+    if (base != NULL && source != NULL) {
+        source->sink = k;
+    }
+    return 0;
+}
+
+int32_t fs_sink_write(fs_sink *k, const uint8_t *p, size_t n)
+{
+    /*
+        Add memory of our own, it has to stay valid until it is sent.
+    */
+    return sink_push(k, p, NULL, 0, n);
+}
+
+int32_t fs_sink_span(fs_sink *k, file_stream *fs, const uint8_t *p, size_t n)
+{
+    /*
+        Add n bytes at p, which fs handed out from its buffer.
+        From a reader, spans of splice_min_size and more are sent from
+        the file. Changes made to them in the buffer are not sent, use
+        fs_sink_write for bytes you changed and keep them until sent.
+    */
+    if (p < fs->buffer || p + n > fs->buffer + fs->buffer_size) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (fs->sink != NULL && fs->sink != k) {
+        // one sink at a time may hold on to our buffer
+        sink_release(fs);
+    }
+    if (n < splice_min_size || (fs->mode & WRITE) || fs->swap_units ||
+        ((fs->mode & MAPPED) && k->pipe)) {
+        return sink_push(k, p, fs, 0, n);
+    }
+    size_t offset = fs->file_ptr - fs->buffer_size + (p - fs->buffer);
+    return sink_push(k, NULL, fs, offset, n);
+}
+
+/*
+    Parallel line processing.
+    The file is cut into one byte range per worker. Every cut is moved
+    forward to just past the next end of line, so no line is split.
+    Each worker reads its range through its own stream, and hands
+    every line to the callback along with its worker index.
+*/
+typedef void (*fs_line_fn)(void *ctx, uint32_t worker, uint8_t *line,
+                           size_t len);
+
+typedef struct fs_line_worker_t
+{
+    pthread_t thread;
+    const char *path;
+    size_t start;
+    size_t end;
+    uint32_t id;
+    fs_line_fn cb;
+    void *ctx;
+    int32_t res;
+} fs_line_worker;
+
+const static uint64_t min_line_range = 1 << 20;
+
+static size_t line_boundary(int32_t fd, size_t offset, size_t size)
+{
+    /*
+        The first position at or after offset that starts a line.
+    */
+    uint8_t window[4096];
+    size_t pos = offset - 1;
+    while (pos < size) {
+        ssize_t opres = pread(fd, window, sizeof(window), pos);
+        if (opres <= 0) {
+            break;
+        }
+        size_t i = scan_eol_8(window, opres, 1, 1);
+        if (i < (size_t)opres) {
+            return pos + i + 1;
+        }
+        pos += opres;
+    }
+    return size;
+}
+
+static void *line_worker_main(void *arg)
+{
+    fs_line_worker *w = (fs_line_worker *)arg;
+    if (w->start >= w->end) {
+        return NULL;
+    }
+    file_stream *fs = fs_open(w->path, "r");
+    if (fs == NULL) {
+        w->res = -1;
+        return NULL;
+    }
+    // our range ends where the next one starts
+    fs->file_size = MIN(fs->file_size, w->end);
+    if (fs_seek(fs, w->start, SEEK_SET) == -1) {
+        w->res = -1;
+        close_stream(fs);
+        return NULL;
+    }
+    uint8_t *line = NULL;
+    size_t len = 0;
+    while ((len = fs_read_line(fs, &line, ASCII)) != 0) {
+        w->cb(w->ctx, w->id, line, len);
+    }
+    close_stream(fs);
+    return NULL;
+}
+
+int32_t fs_for_each_line(const char *p, uint32_t workers, fs_line_fn cb,
+                         void *ctx)
+{
+    /*
+        Run cb for every ASCII line of the file on up to workers threads,
+        or one per cpu when workers is 0. Lines from one worker arrive in
+        file order. Returns -1 when the file could not be read.
+    */
+    int32_t fd = open(p, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat stats;
+    if (fstat(fd, &stats) == -1) {
+        close(fd);
+        return -1;
+    }
+    size_t size = stats.st_size;
+    if (workers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus > 0 ? (uint32_t)cpus : 1;
+    }
+    // small ranges are not worth a thread
+    workers = MAX(1, MIN(workers, size / min_line_range));
+    if (!scan_table.selected) {
+        fs_set_scan_isa(fs_best_scan_isa());
+    }
+
+    fs_line_worker *w =
+        (fs_line_worker *)calloc(workers, sizeof(fs_line_worker));
+    if (w == NULL) {
+        close(fd);
+        return -1;
+    }
+    size_t start = 0;
+    for (uint32_t i = 0; i < workers; i++) {
+        size_t end = size;
+        if (i + 1 < workers) {
+            end = MAX(start, line_boundary(fd, (size / workers) * (i + 1),
+                                           size));
+        }
+        w[i].path = p;
+        w[i].start = start;
+        w[i].end = end;
+        w[i].id = i;
+        w[i].cb = cb;
+        w[i].ctx = ctx;
+        start = end;
+    }
+    close(fd);
+
+    // the caller runs the first range itself
+    for (uint32_t i = 1; i < workers; i++) {
+        if (pthread_create(&w[i].thread, NULL, line_worker_main, &w[i]) !=
+            0) {
+            // run it here instead
+            w[i].thread = pthread_self();
+            line_worker_main(&w[i]);
+        }
+    }
+    line_worker_main(&w[0]);
+    int32_t res = w[0].res;
+    for (uint32_t i = 1; i < workers; i++) {
+        if (!pthread_equal(w[i].thread, pthread_self())) {
+            pthread_join(w[i].thread, NULL);
+        }
+        res |= w[i].res;
+    }
+    free(w);
+    return res;
+}
+
+bit_stream *bs_open(const char *p, char *mode)
+{
+    bit_stream *bs = (bit_stream *)create_stream(sizeof(bit_stream), p, mode);
+    if (bs == NULL) {
+        return NULL;
+    }
+    // writers start on an empty word, readers load one on demand
+    bs->mask = (bs->base.animal.mode & WRITE) ? partmask : 0;
+    bs->part = 0;
+    bs->ahead = 0;
+    bs->has_ahead = 0;
+    return bs;
+}
+
+static inline uint64_t low_bits(uint64_t value, uint32_t nbits)
+{
+    return nbits >= 64 ? value : value & ((1ull << nbits) - 1);
+}
+
+static inline void bs_store(bit_stream *bs, uint64_t word)
+{
+    uint64_t *dst = (uint64_t *)fs_write((file_stream *)bs, sizeof(uint64_t));
+    if (dst) {
+        *dst = word;
+    }
+}
+
+static inline uint64_t bs_load(bit_stream *bs)
+{
+    // the word after part, zero past the end of the file
+    if (bs->has_ahead) {
+        bs->has_ahead = 0;
+        return bs->ahead;
+    }
+    size_t expected = 0;
+    uint8_t *src = fs_read((file_stream *)bs, sizeof(uint64_t), &expected);
+    if (src == NULL) {
+        return 0;
+    }
+    if (expected == sizeof(uint64_t)) {
+        return *(uint64_t *)src;
+    }
+    uint64_t word = 0;
+    memcpy(&word, src, expected);
+    return word;
+}
+
+uint8_t bs_write(bit_stream *bs, int bit)
+{
+    if (bit) {
+        bs->part |= bs->mask;
+    }
+
+    bs->mask = bs->mask >> 1;
+    if (bs->mask == 0) {
+        bs_store(bs, bs->part);
+        bs->part = 0;
+        bs->mask = partmask;
+        return 1;
+    }
+    return 0;
+}
+
+uint32_t bs_read(bit_stream *bs)
+{
+    if (bs->mask == 0) {
+        bs->part = bs_load(bs);
+        bs->mask = partmask;
+    }
+    uint32_t result = (bs->part & bs->mask) != 0;
+    bs->mask = bs->mask >> 1;
+    return result;
+}
+
+uint8_t bs_write_bits(bit_stream *bs, uint64_t value, uint32_t nbits)
+{
+    /*
+        Write the low nbits (1 to 64) of value, most significant first.
+        Returns 1 when a word went out to the stream.
+    */
+    uint32_t room = __builtin_ctzll(bs->mask) + 1;
+    value = low_bits(value, nbits);
+    if (nbits < room) {
+        bs->part |= value << (room - nbits);
+        bs->mask >>= nbits;
+        return 0;
+    }
+    uint32_t rest = nbits - room;
+    bs_store(bs, bs->part | (value >> rest));
+    bs->part = rest ? value << (64 - rest) : 0;
+    bs->mask = partmask >> rest;
+    return 1;
+}
+
+static inline uint32_t bs_remaining(bit_stream *bs)
+{
+    return bs->mask ? __builtin_ctzll(bs->mask) + 1 : 0;
+}
+
+uint64_t bs_peek_bits(bit_stream *bs, uint32_t nbits)
+{
+    /*
+        The next nbits (1 to 64) without consuming them.
+    */
+    uint32_t left = bs_remaining(bs);
+    uint64_t unread = low_bits(bs->part, left);
+    if (nbits <= left) {
+        return low_bits(unread >> (left - nbits), nbits);
+    }
+    if (!bs->has_ahead) {
+        bs->ahead = bs_load(bs);
+        bs->has_ahead = 1;
+    }
+    uint32_t rest = nbits - left;
+    uint64_t head = left ? unread << rest : 0;
+    return head | (bs->ahead >> (64 - rest));
+}
+
+uint64_t bs_read_bits(bit_stream *bs, uint32_t nbits)
+{
+    /*
+        Read nbits (1 to 64), most significant first.
+        Reads past the end of the file come back as zero bits.
+    */
+    uint32_t left = bs_remaining(bs);
+    uint64_t unread = low_bits(bs->part, left);
+    if (nbits <= left) {
+        bs->mask = nbits == 64 ? 0 : bs->mask >> nbits;
+        return low_bits(unread >> (left - nbits), nbits);
+    }
+    uint32_t rest = nbits - left;
+    uint64_t head = left ? unread << rest : 0;
+    bs->part = bs_load(bs);
+    bs->mask = rest == 64 ? 0 : partmask >> rest;
+    return head | (bs->part >> (64 - rest));
+}
+
+void bs_skip_bits(bit_stream *bs, uint64_t nbits)
+{
+    while (nbits > 0) {
+        uint32_t step = nbits > 64 ? 64 : (uint32_t)nbits;
+        bs_read_bits(bs, step);
+        nbits -= step;
+    }
+}
+
+void bs_align(bit_stream *bs)
+{
+    /*
+        Move to the next multiple of 8 bits in the stream.
+        Writers pad with zero bits, readers drop the rest of the byte.
+    */
+    if (bs->base.animal.mode & WRITE) {
+        uint32_t used = 64 - (__builtin_ctzll(bs->mask) + 1);
+        if (used % 8) {
+            bs_write_bits(bs, 0, 8 - (used % 8));
+        }
+    } else {
+        uint32_t left = bs_remaining(bs);
+        if (left % 8) {
+            bs_read_bits(bs, left % 8);
+        }
+    }
+}
+
+int32_t bs_flush(bit_stream *bs)
+{
+    /*
+        Write out the partial word, padded with zero bits,
+        and flush the stream under it.
+    */
+    if ((bs->base.animal.mode & WRITE) && bs->mask != partmask) {
+        bs_store(bs, bs->part);
+        bs->part = 0;
+        bs->mask = partmask;
+    }
+    return fs_flush((file_stream *)bs);
+}
+
+int32_t bs_close(bit_stream *bs)
+{
+    if (bs == NULL) {
+        return 0;
+    }
+    int32_t res = bs_flush(bs);
+    int32_t closed = close_stream((file_stream *)bs);
+    return res ? res : closed;
+}
+
+/*
+    Text streams.
+    A text stream converts utf8, utf16 or utf32 input into one of
+    those encodings, a stream buffer at a time. Runs of ascii are found
+    with the vector scanners and widened or narrowed in bulk, everything
+    else is decoded and validated one code point at a time. Malformed
+    input becomes U+FFFD. A code point cut by the end of the stream
+    buffer is left unread, so the next fill keeps it contiguous.
+    Output is native endian, counted in code units.
+*/
+typedef struct text_stream_t
+{
+    union // C inheritance trick
+    {
+        file_stream animal;
+    } base;
+    file_stream_type from;
+    file_stream_type to;
+    // converted text, [out_ptr, out_size) is not handed out yet
+    uint8_t *out;
+    size_t out_ptr;
+    size_t out_size;
+    size_t out_capacity;
+    // malformed sequences we replaced
+    uint64_t errors;
+} text_stream;
+
+static const uint32_t replacement_char = 0xFFFD;
+
+#define declare_ascii_copy(name, in_type, out_type)                            \
+    static void name(const uint8_t *in, uint8_t *out, size_t n)               \
+    {                                                                          \
+        const in_type *src = (const in_type *)in;                              \
+        out_type *dst = (out_type *)out;                                       \
+        for (size_t i = 0; i < n; i++) {                                       \
+            dst[i] = (out_type)src[i];                                         \
+        }                                                                      \
+    }
+
+declare_ascii_copy(ascii_8_to_8, uint8_t, uint8_t);
+declare_ascii_copy(ascii_8_to_16, uint8_t, uint16_t);
+declare_ascii_copy(ascii_8_to_32, uint8_t, uint32_t);
+declare_ascii_copy(ascii_16_to_8, uint16_t, uint8_t);
+declare_ascii_copy(ascii_16_to_16, uint16_t, uint16_t);
+declare_ascii_copy(ascii_16_to_32, uint16_t, uint32_t);
+declare_ascii_copy(ascii_32_to_8, uint32_t, uint8_t);
+declare_ascii_copy(ascii_32_to_16, uint32_t, uint16_t);
+declare_ascii_copy(ascii_32_to_32, uint32_t, uint32_t);
+
+typedef void (*ts_copy_fn)(const uint8_t *in, uint8_t *out, size_t n);
+
+// indexed by unit size / 2
+static const ts_copy_fn ascii_copy[3][3] = {
+    {ascii_8_to_8, ascii_8_to_16, ascii_8_to_32},
+    {ascii_16_to_8, ascii_16_to_16, ascii_16_to_32},
+    {ascii_32_to_8, ascii_32_to_16, ascii_32_to_32}};
+
+static int32_t decode_utf8(const uint8_t *p, size_t n, uint32_t *cp)
+{
+    /*
+        Returns the length of a well formed sequence, 0 when n cuts it
+        short, or minus the length of the malformed part.
+    */
+    uint8_t c = p[0];
+    uint8_t lo = 0x80;
+    uint8_t hi = 0xBF;
+    size_t len = 0;
+    uint32_t v = 0;
+    if (c < 0x80) {
+        *cp = c;
+        return 1;
+    } else if (c >= 0xC2 && c <= 0xDF) {
+        len = 2;
+        v = c & 0x1F;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        // no overlongs and no surrogates
+        len = 3;
+        v = c & 0x0F;
+        lo = c == 0xE0 ? 0xA0 : lo;
+        hi = c == 0xED ? 0x9F : hi;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        // no overlongs and nothing past U+10FFFF
+        len = 4;
+        v = c & 0x07;
+        lo = c == 0xF0 ? 0x90 : lo;
+        hi = c == 0xF4 ? 0x8F : hi;
+    } else {
+        return -1;
+    }
+    for (size_t k = 1; k < len; k++) {
+        if (k >= n) {
+            return 0;
+        }
+        if (p[k] < lo || p[k] > hi) {
+            return -(int32_t)k;
+        }
+        lo = 0x80;
+        hi = 0xBF;
+        v = (v << 6) | (p[k] & 0x3F);
+    }
+    *cp = v;
+    return len;
+}
+
+static int32_t decode_utf16(const uint8_t *p, size_t n, uint32_t *cp)
+{
+    if (n < 2) {
+        return 0;
+    }
+    uint32_t u = *(uint16_t *)p;
+    if (u < 0xD800 || u > 0xDFFF) {
+        *cp = u;
+        return 2;
+    }
+    if (u >= 0xDC00) {
+        // a low surrogate on its own
+        return -2;
+    }
+    if (n < 4) {
+        return 0;
+    }
+    uint32_t l = *(uint16_t *)&p[2];
+    if (l < 0xDC00 || l > 0xDFFF) {
+        return -2;
+    }
+    *cp = 0x10000 + ((u - 0xD800) << 10) + (l - 0xDC00);
+    return 4;
+}
+
+static int32_t decode_utf32(const uint8_t *p, size_t n, uint32_t *cp)
+{
+    if (n < 4) {
+        return 0;
+    }
+    uint32_t u = *(uint32_t *)p;
+    if (u > 0x10FFFF || (u >= 0xD800 && u <= 0xDFFF)) {
+        return -4;
+    }
+    *cp = u;
+    return 4;
+}
+
+static size_t encode_utf8(uint32_t cp, uint8_t *out)
+{
+    if (cp < 0x80) {
+        out[0] = cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = 0xC0 | (cp >> 6);
+        out[1] = 0x80 | (cp & 0x3F);
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = 0xE0 | (cp >> 12);
+        out[1] = 0x80 | ((cp >> 6) & 0x3F);
+        out[2] = 0x80 | (cp & 0x3F);
+        return 3;
+    }
+    out[0] = 0xF0 | (cp >> 18);
+    out[1] = 0x80 | ((cp >> 12) & 0x3F);
+    out[2] = 0x80 | ((cp >> 6) & 0x3F);
+    out[3] = 0x80 | (cp & 0x3F);
+    return 4;
+}
+
+static size_t encode_utf16(uint32_t cp, uint8_t *out)
+{
+    if (cp < 0x10000) {
+        *(uint16_t *)out = cp;
+        return 2;
+    }
+    cp -= 0x10000;
+    *(uint16_t *)out = 0xD800 + (cp >> 10);
+    *(uint16_t *)&out[2] = 0xDC00 + (cp & 0x3FF);
+    return 4;
+}
+
+static size_t encode_utf32(uint32_t cp, uint8_t *out)
+{
+    *(uint32_t *)out = cp;
+    return 4;
+}
+
+static size_t transcode(text_stream *ts, const uint8_t *in, size_t n,
+                        int32_t last, size_t *consumed)
+{
+    /*
+        Convert in[0, n) into the free end of our output buffer.
+        Stops at a cut code point unless this is the last input,
+        or when the next code point might not fit.
+    */
+    size_t from = ts->from;
+    size_t to = ts->to;
+    fs_scan_fn ascii = from == ASCII        ? scan_table.ascii_8
+                       : from == UNICODE_16 ? scan_table.ascii_16
+                                            : scan_table.ascii_32;
+    ts_copy_fn copy = ascii_copy[from / 2][to / 2];
+    size_t i = 0;
+    size_t o = ts->out_size;
+    while (i < n && (o + 4) <= ts->out_capacity) {
+        size_t units = MIN((n - i) / from, (ts->out_capacity - o) / to);
+        size_t run = ascii(&in[i], units * from, 1, 0) / from;
+        copy(&in[i], &ts->out[o], run);
+        i += run * from;
+        o += run * to;
+        if ((run > 0 && run == units) || (o + 4) > ts->out_capacity) {
+            continue;
+        }
+        uint32_t cp = 0;
+        int32_t len = from == ASCII        ? decode_utf8(&in[i], n - i, &cp)
+                      : from == UNICODE_16 ? decode_utf16(&in[i], n - i, &cp)
+                                           : decode_utf32(&in[i], n - i, &cp);
+        if (len == 0) {
+            if (!last) {
+                break;
+            }
+            // the input ends in the middle of a code point
+            len = -(int32_t)(n - i);
+        }
+        if (len < 0) {
+            ts->errors++;
+            len = -len;
+            cp = replacement_char;
+        }
+        i += len;
+        o += to == ASCII        ? encode_utf8(cp, &ts->out[o])
+             : to == UNICODE_16 ? encode_utf16(cp, &ts->out[o])
+                                : encode_utf32(cp, &ts->out[o]);
+    }
+    *consumed = i;
+    size_t produced = o - ts->out_size;
+    ts->out_size = o;
+    return produced;
+}
+
+static size_t ts_fill(text_stream *ts, size_t need)
+{
+    /*
+        Convert more input, until need bytes are waiting or the input
+        ends. Returns how many bytes we added.
+    */
+    file_stream *fs = &ts->base.animal;
+    size_t left = ts->out_size - ts->out_ptr;
+    if (ts->out_ptr > 0) {
+        memmove(ts->out, &ts->out[ts->out_ptr], left);
+        ts->out_ptr = 0;
+        ts->out_size = left;
+    }
+    if ((need + 4) > ts->out_capacity) {
+        // a rare request larger than our buffer
+        size_t capacity = MAX(next_page_multiple(need + 4),
+                              ts->out_capacity * 2);
+        uint8_t *out = alloc_buffer(capacity);
+        if (out == NULL) {
+            return 0;
+        }
+        memcpy(out, ts->out, left);
+        release_buffer(ts->out, ts->out_capacity);
+        ts->out = out;
+        ts->out_capacity = capacity;
+    }
+    size_t added = 0;
+    while ((ts->out_size + 4) <= ts->out_capacity &&
+           (added == 0 || ts->out_size < need)) {
+        /*
+            Take what is left in the stream buffer, or refill it
+            when all that is left is part of a code point.
+        */
+        size_t avail = fs->file_ptr - fs->buffer_ptr;
+        size_t got = 0;
+        uint8_t *in = fs_read(fs, MAX(avail, 4), &got);
+        if (in == NULL) {
+            break;
+        }
+        int32_t last = fs->buffer_ptr == fs->file_ptr &&
+                       fs->file_ptr == fs->file_size;
+        size_t consumed = 0;
+        added += transcode(ts, in, got, last, &consumed);
+        // hand back what we did not convert
+        fs->buffer_ptr -= got - consumed;
+        if (consumed == 0) {
+            break;
+        }
+    }
+    return added;
+}
+
+text_stream *ts_open(const char *p, char *mode, file_stream_type from,
+                     file_stream_type to)
+{
+    /*
+        Open p for reading and convert it to the to encoding.
+        With from 0 the byte order mark picks the input encoding,
+        and utf8 without one.
+    */
+    char text_mode[16];
+    size_t len = strlen(mode);
+    if (mode[0] != 'r' || len + 2 > sizeof(text_mode)) {
+        return NULL;
+    }
+    memcpy(text_mode, mode, len + 1);
+    if (strchr(mode, 't') == NULL) {
+        text_mode[len] = 't';
+        text_mode[len + 1] = '\0';
+    }
+    text_stream *ts =
+        (text_stream *)create_stream(sizeof(text_stream), p, text_mode);
+    if (ts == NULL) {
+        return NULL;
+    }
+    file_stream *fs = &ts->base.animal;
+    if (fs->bom_size > 0) {
+        fs_seek(fs, fs->bom_size, SEEK_SET);
+    }
+    ts->from = from ? from : (fs->encoding ? fs->encoding : ASCII);
+    ts->to = to;
+    ts->out_ptr = 0;
+    ts->out_size = 0;
+    ts->out_capacity = alloc_size;
+    ts->errors = 0;
+    ts->out = alloc_buffer(ts->out_capacity);
+    if (ts->out == NULL) {
+        close_stream(fs);
+        return NULL;
+    }
+    return ts;
+}
+
+uint8_t *ts_read(text_stream *ts, size_t desired, size_t *result)
+{
+    /*
+        Hand out up to desired converted code units,
+        result is set to how many we have.
+    */
+    size_t to = ts->to;
+    size_t need = desired * to;
+    if ((ts->out_size - ts->out_ptr) < need) {
+        ts_fill(ts, need);
+    }
+    size_t avail = ts->out_size - ts->out_ptr;
+    *result = MIN(avail, need) / to;
+    if (*result == 0) {
+        return NULL;
+    }
+    uint8_t *res = &ts->out[ts->out_ptr];
+    ts->out_ptr += *result * to;
+    return res;
+}
+
+size_t ts_read_line(text_stream *ts, uint8_t **line_start)
+{
+    /*
+        The next line of converted text, in code units.
+        Like fs_read_line, empty lines are skipped.
+    */
+    size_t to = ts->to;
+    fs_scan_fn eol = to == ASCII        ? scan_table.eol_8
+                     : to == UNICODE_16 ? scan_table.eol_16
+                                        : scan_table.eol_32;
+    for (;;) {
+        size_t avail = ts->out_size - ts->out_ptr;
+        size_t skip = eol(&ts->out[ts->out_ptr], avail, 1, 0);
+        ts->out_ptr += skip;
+        if (skip < avail) {
+            break;
+        }
+        if (ts_fill(ts, to) == 0) {
+            return 0;
+        }
+    }
+    size_t line_len = 0;
+    for (;;) {
+        size_t avail = ts->out_size - ts->out_ptr;
+        line_len += eol(&ts->out[ts->out_ptr + line_len], avail - line_len,
+                        1, 1);
+        if (line_len < avail || ts_fill(ts, line_len + to) == 0) {
+            break;
+        }
+    }
+    *line_start = &ts->out[ts->out_ptr];
+    ts->out_ptr += line_len;
+    return line_len / to;
+}
+
+int32_t ts_close(text_stream *ts)
+{
+    if (ts == NULL) {
+        return 0;
+    }
+    release_buffer(ts->out, ts->out_capacity);
+    return close_stream((file_stream *)ts);
+}
+
+/*
+    Record streams.
+    A record stream reads a file as an array of fixed size records and
+    hands out as many whole records as sit contiguous in the stream
+    buffer per call, instead of one fs_read per record. A record that
+    straddles the end of the buffer is pulled in whole by the refill in
+    record_read, so callers only ever see complete records. A partial
+    record at the end of the file is left for fs_read.
+    Refills start on a page or at the next record, so records that begin
+    at file offsets aligned for their type are aligned in memory too.
+*/
+typedef struct record_stream_t
+{
+    union // C inheritance trick
+    {
+        file_stream animal;
+    } base;
+    size_t record_size;
+} record_stream;
+
+static inline uint8_t *record_read(file_stream *fs, size_t size, size_t max,
+                                   size_t *count)
+{
+    size_t avail = fs->file_ptr - fs->buffer_ptr;
+    if (avail < size) {
+        // the one place a record can straddle the buffer end
+        if (fs->file_ptr != fs->file_size) {
+            sync_stream_read(fs, size);
+        }
+        avail = fs->file_ptr - fs->buffer_ptr;
+        if (avail < size) {
+            *count = 0;
+            return NULL;
+        }
+    }
+    size_t n = MIN(avail / size, max);
+    uint8_t *res =
+        &fs->buffer[(fs->buffer_ptr + fs->buffer_size) - fs->file_ptr];
+    fs->buffer_ptr += n * size;
+    *count = n;
+    return res;
+}
+
+/*
+    A reader specialised for one record type, the record size is
+    a constant so the batch arithmetic folds away.
+    declare_record_reader(telemetry_read, telemetry) gives
+    telemetry *telemetry_read(record_stream *rs, size_t max, size_t *count)
+    for a stream opened with rs_open(p, "r", sizeof(telemetry)).
+*/
+#define declare_record_reader(name, type)                                      \
+    static inline type *name(record_stream *rs, size_t max, size_t *count)     \
+    {                                                                          \
+        return (type *)record_read(&rs->base.animal, sizeof(type), max,        \
+                                   count);                                     \
+    }
+
+record_stream *rs_open(const char *p, char *mode, size_t record_size)
+{
+    if (mode[0] != 'r' || record_size == 0) {
+        return NULL;
+    }
+    record_stream *rs =
+        (record_stream *)create_stream(sizeof(record_stream), p, mode);
+    if (rs == NULL) {
+        return NULL;
+    }
+    rs->record_size = record_size;
+    return rs;
+}
+
+uint8_t *rs_read(record_stream *rs, size_t max, size_t *count)
+{
+    /*
+        Up to max whole records, count is set to how many we have.
+    */
+    return record_read(&rs->base.animal, rs->record_size, max, count);
+}
+
+int32_t rs_close(record_stream *rs) { return close_stream((file_stream *)rs); }
+
+/*
+    Csv streams.
+    A csv stream splits delimited text into rows of fields. Every 64
+    byte block is classified into quote, delimiter and newline bitmaps
+    by the vector kernels. A prefix xor of the quote bits marks what is
+    inside quotes, and the delimiters and newlines left outside cut the
+    fields. Fields point into the stream buffer and stay valid until the
+    next cs_read_row. A row that runs past the end of the buffer is
+    refilled contiguous, the same as fs_read_line does.
+    Quoted fields come without their outer quotes and with quoted set,
+    doubled quotes inside them are left for cs_unquote. A carriage
+    return before the newline is dropped, and empty lines are skipped.
+    Blocks are classified once, the cuts left over after a row are
+    kept for the next one.
+*/
+typedef struct csv_field_t
+{
+    uint8_t *start;
+    size_t size;
+    // where the field starts in its row
+    size_t offset;
+    uint32_t quoted;
+} csv_field;
+
+typedef struct csv_stream_t
+{
+    union // C inheritance trick
+    {
+        file_stream animal;
+    } base;
+    // quote, delimiter and newline, a zero quote turns quoting off
+    uint8_t set[3];
+    csv_field *fields;
+    size_t count;
+    size_t capacity;
+    // the classified block ends at next, its cuts not handed out yet
+    size_t next;
+    uint64_t cuts;
+    uint64_t eols;
+    // all ones while the scan is inside quotes
+    uint64_t inside;
+    // where the last row ended
+    size_t row_end;
+} csv_stream;
+
+static inline uint64_t prefix_xor(uint64_t x)
+{
+    // bit i becomes the parity of the bits [0, i]
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+static int32_t csv_push(csv_stream *cs, const uint8_t *row, size_t start,
+                        size_t end, int32_t eol)
+{
+    if (cs->count == cs->capacity) {
+        size_t capacity = MAX(cs->capacity * 2, 64);
+        csv_field *fields =
+            (csv_field *)realloc(cs->fields, capacity * sizeof(csv_field));
+        if (fields == NULL) {
+            return -1;
+        }
+        cs->fields = fields;
+        cs->capacity = capacity;
+    }
+    csv_field *f = &cs->fields[cs->count++];
+    if (eol && end > start && row[end - 1] == '\r') {
+        end--;
+    }
+    f->quoted = 0;
+    if (cs->set[0] && end > start && row[start] == cs->set[0]) {
+        f->quoted = 1;
+        start++;
+        if (end > start && row[end - 1] == cs->set[0]) {
+            end--;
+        }
+    }
+    f->offset = start;
+    f->size = end - start;
+    return 0;
+}
+
+csv_stream *cs_open(const char *p, char *mode, uint8_t delim, uint8_t quote)
+{
+    /*
+        Open p for reading as delim separated rows,
+        "," and '"' for csv, '\t' and 0 for tsv.
+    */
+    if (mode[0] != 'r' || strchr(mode, '+') != NULL || delim == '\n' ||
+        delim == quote) {
+        return NULL;
+    }
+    csv_stream *cs = (csv_stream *)create_stream(sizeof(csv_stream), p, mode);
+    if (cs == NULL) {
+        return NULL;
+    }
+    cs->set[0] = quote;
+    cs->set[1] = delim;
+    cs->set[2] = '\n';
+    cs->fields = NULL;
+    cs->count = 0;
+    cs->capacity = 0;
+    cs->next = 0;
+    cs->cuts = 0;
+    cs->eols = 0;
+    cs->inside = 0;
+    cs->row_end = 0;
+    return cs;
+}
+
+static int32_t csv_blank(const uint8_t *row, size_t start, size_t end)
+{
+    for (size_t i = start; i < end; i++) {
+        if (row[i] != '\r') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+size_t cs_read_row(csv_stream *cs, csv_field **fields)
+{
+    /*
+        The fields of the next row, returns how many there are
+        or 0 at the end of the stream.
+    */
+    file_stream *fs = &cs->base.animal;
+    if (fs->buffer_ptr != cs->row_end) {
+        // the stream was moved, classify from here on
+        cs->next = fs->buffer_ptr;
+        cs->cuts = 0;
+        cs->inside = 0;
+    }
+    size_t start = 0;
+    uint8_t *row = NULL;
+    cs->count = 0;
+    for (;;) {
+        row = &fs->buffer[(fs->buffer_ptr + fs->buffer_size) - fs->file_ptr];
+        while (cs->cuts) {
+            uint32_t bit = __builtin_ctzll(cs->cuts);
+            size_t at = (cs->next - 64 + bit) - fs->buffer_ptr;
+            int32_t eol = (cs->eols >> bit) & 1;
+            cs->cuts &= cs->cuts - 1;
+            if (eol && cs->count == 0 && csv_blank(row, start, at)) {
+                // an empty line
+                fs->buffer_ptr += at + 1;
+                row += at + 1;
+                continue;
+            }
+            if (csv_push(cs, row, start, at, eol) == -1) {
+                return 0;
+            }
+            start = at + 1;
+            if (eol) {
+                fs->buffer_ptr += start;
+                goto done;
+            }
+        }
+        if ((cs->next + 64) > fs->file_ptr && fs->file_ptr != fs->file_size) {
+            // keep the row and the next block contiguous
+            if (sync_stream_read(fs, (cs->next + 64) - fs->buffer_ptr) == 0) {
+                return 0;
+            }
+            continue;
+        }
+        size_t end = fs->file_ptr - fs->buffer_ptr;
+        if (cs->next >= fs->file_ptr) {
+            // the last row has no newline
+            fs->buffer_ptr += end;
+            cs->row_end = fs->buffer_ptr;
+            if (cs->count == 0 && csv_blank(row, start, end)) {
+                return 0;
+            }
+            if (csv_push(cs, row, start, end, 1) == -1) {
+                return 0;
+            }
+            break;
+        }
+        uint64_t masks[3];
+        uint64_t valid = ~0ull;
+        size_t at = cs->next - fs->buffer_ptr;
+        if ((end - at) < 64) {
+            uint8_t block[64] = {0};
+            memcpy(block, &row[at], end - at);
+            scan_table.class_64(block, cs->set, masks);
+            valid = (1ull << (end - at)) - 1;
+        } else {
+            scan_table.class_64(&row[at], cs->set, masks);
+        }
+        uint64_t quotes = cs->set[0] ? masks[0] & valid : 0;
+        uint64_t in = prefix_xor(quotes) ^ cs->inside;
+        cs->inside = (uint64_t)((int64_t)in >> 63);
+        cs->cuts = (masks[1] | masks[2]) & ~in & valid;
+        cs->eols = masks[2];
+        cs->next += 64;
+    }
+done:
+    cs->row_end = fs->buffer_ptr;
+    for (size_t i = 0; i < cs->count; i++) {
+        cs->fields[i].start = &row[cs->fields[i].offset];
+    }
+    *fields = cs->fields;
+    return cs->count;
+}
+
+size_t cs_unquote(csv_stream *cs, csv_field *field, uint8_t *out)
+{
+    /*
+        Copy a field to out with its doubled quotes made single,
+        out needs room for field->size bytes. Returns the size.
+    */
+    uint8_t quote = cs->set[0];
+    size_t o = 0;
+    for (size_t i = 0; i < field->size; i++) {
+        out[o++] = field->start[i];
+        if (field->quoted && field->start[i] == quote &&
+            (i + 1) < field->size && field->start[i + 1] == quote) {
+            i++;
+        }
+    }
+    return o;
+}
+
+int32_t cs_close(csv_stream *cs)
+{
+    if (cs == NULL) {
+        return 0;
+    }
+    free(cs->fields);
+    return close_stream((file_stream *)cs);
+}
+
+/*
+    Log streams.
+    A log stream is an append only file that many threads can add records
+    to and make durable. Appenders copy their record into the open group
+    under the lock and get a ticket back, the log offset just past their
+    record. A single flusher swaps the open group for the idle one, writes
+    it with one pwrite and syncs it with one fdatasync, so everyone who
+    appended to that group is committed together. The flusher takes a
+    group once window_size bytes are pending or window_us has passed since
+    its first record, and at once when an appender waits for space.
+    A write or sync error sticks, the log can not tell what reached the
+    disk after it.
+*/
+typedef struct log_stream_t
+{
+    union // C inheritance trick
+    {
+        file_stream animal;
+    } base;
+    // the base stream buffers the open group, [file_ptr, buffer_ptr)
+    // of the log. the other group is idle or being written.
+    pthread_t thread;
+    pthread_mutex_t lock;
+    // wakes the flusher
+    pthread_cond_t wake;
+    // wakes appenders and committers
+    pthread_cond_t done;
+    uint8_t *groups[2];
+    size_t capacity[2];
+    uint32_t open;
+    size_t window_size;
+    uint64_t window_ns;
+    // when the first record went into the open group
+    uint64_t opened;
+    // appenders waiting for space
+    uint32_t blocked;
+    // the log is synced up to here
+    size_t durable;
+    int32_t exit;
+    int32_t error;
+} log_stream;
+
+static inline uint64_t log_now()
+{
+    // condition waits time out against the real time clock
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline int32_t log_sync(int32_t fd)
+{
+#if defined(LINUX)
+    return fdatasync(fd);
+#else
+    return fsync(fd);
+#endif
+}
+
+static int32_t log_wait(log_stream *ls, size_t pending)
 {
     /*
-        Sync the stream and the internal buffer.
+        Returns 1 when the open group should go out now. Otherwise
+        waits for a wake up or the window to pass and returns 0.
     */
-
-    ssize_t opres = 0;
-    // flush our buffer
-    if ((opres = write(fs->fd, fs->buffer, fs->buffer_ptr - fs->file_ptr)) ==
-        -1) {
-        return 0;
+    if (ls->exit || ls->blocked > 0 || pending >= ls->window_size) {
+        return 1;
     }
-    fs->file_ptr += opres;
-    if ((fs->buffer_ptr % fs->buffer_size) == 0) {
-        /*
-            The fast path when you are streaming fixed sizes
-        */
-        if (sm > fs->buffer_size) {
-            /*
-                A rare case where you are at the very border
-                but the size is larger then the buffer.
-            */
-            size_t offset = resize_buffer(fs, sm);
-            if (offset > 0) {
-                if ((opres = read(fs->fd, fs->buffer, offset)) == -1) {
-                    return 0;
-                }
+    uint64_t deadline = ls->opened + ls->window_ns;
+    if (log_now() >= deadline) {
+        return 1;
+    }
+    struct timespec ts = {(time_t)(deadline / 1000000000),
+                          (long)(deadline % 1000000000)};
+    return pthread_cond_timedwait(&ls->wake, &ls->lock, &ts) == ETIMEDOUT;
+}
+
+static void *log_main(void *arg)
+{
+    /*
+        The flusher writes one group while the appenders fill the other.
+    */
+    log_stream *ls = (log_stream *)arg;
+    file_stream *fs = &ls->base.animal;
+    pthread_mutex_lock(&ls->lock);
+    for (;;) {
+        size_t pending = fs->buffer_ptr - fs->file_ptr;
+        if (pending == 0) {
+            if (ls->exit) {
+                break;
             }
-            fs->file_ptr += offset;
+            pthread_cond_wait(&ls->wake, &ls->lock);
+            continue;
         }
-    } else {
-        /*
-            We still have data left in our current buffer.
-            And want to stream the next part.
-        */
-        size_t offset = resize_buffer(fs, sm);
-        if (offset > 0) {
-            if ((opres = read(fs->fd, fs->buffer, offset)) == -1) {
-                return 0;
+        if (!log_wait(ls, pending)) {
+            continue;
+        }
+        uint8_t *group = fs->buffer;
+        size_t offset = fs->file_ptr;
+        size_t end = fs->buffer_ptr;
+        ls->open ^= 1;
+        fs->buffer = ls->groups[ls->open];
+        fs->file_ptr = end;
+        pthread_cond_broadcast(&ls->done);
+        pthread_mutex_unlock(&ls->lock);
+        int32_t error = 0;
+        while (offset < end) {
+            ssize_t opres = fs_sys_pwrite(fs, group, end - offset, offset);
+            if (opres == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                error = errno;
+                break;
             }
+            group += opres;
+            offset += opres;
         }
-        fs->file_ptr += offset;
+        if (error == 0 && log_sync(fs->fd) == -1) {
+            error = errno;
+        }
+        pthread_mutex_lock(&ls->lock);
+        if (error == 0) {
+            ls->durable = end;
+            fs->file_size = end;
+        } else if (ls->error == 0) {
+            ls->error = error;
+        }
+        pthread_cond_broadcast(&ls->done);
     }
+    pthread_mutex_unlock(&ls->lock);
+    return NULL;
+}
 
-    return opres;
+log_stream *ls_open(const char *p, char *mode, size_t window_size,
+                    uint32_t window_us)
+{
+    /*
+        Open p as a log, "w" starts it empty and "a" continues it.
+        window_size 0 takes the write behind block size.
+    */
+    if ((mode[0] != 'w' && mode[0] != 'a') || mode[1] != '\0') {
+        return NULL;
+    }
+    // logs are written to be replayed, by whoever reads them
+    log_stream *ls = (log_stream *)open_stream(sizeof(log_stream), p, mode,
+                                               SHARED_FILE_MODE);
+    if (ls == NULL) {
+        return NULL;
+    }
+    file_stream *fs = &ls->base.animal;
+    // the groups replace the stream buffer
+    release_buffer(fs->buffer, fs->buffer_capacity);
+    fs->buffer = NULL;
+    fs->buffer_capacity = 0;
+    fs->file_ptr = fs->file_size;
+    fs->buffer_ptr = fs->file_size;
+    ls->window_size = window_size ? window_size : write_behind_size;
+    ls->window_ns = (uint64_t)window_us * 1000;
+    ls->open = 0;
+    ls->opened = 0;
+    ls->blocked = 0;
+    ls->durable = fs->file_size;
+    ls->exit = 0;
+    ls->error = 0;
+    for (uint32_t i = 0; i < 2; i++) {
+        ls->capacity[i] = next_page_multiple(ls->window_size);
+        ls->groups[i] = alloc_buffer(ls->capacity[i]);
+    }
+    if (ls->groups[0] == NULL || ls->groups[1] == NULL) {
+        release_buffer(ls->groups[0], ls->capacity[0]);
+        release_buffer(ls->groups[1], ls->capacity[1]);
+        close_stream(fs);
+        return NULL;
+    }
+    fs->buffer = ls->groups[0];
+    pthread_mutex_init(&ls->lock, NULL);
+    pthread_cond_init(&ls->wake, NULL);
+    pthread_cond_init(&ls->done, NULL);
+    if (pthread_create(&ls->thread, NULL, log_main, ls) != 0) {
+        pthread_cond_destroy(&ls->done);
+        pthread_cond_destroy(&ls->wake);
+        pthread_mutex_destroy(&ls->lock);
+        release_buffer(ls->groups[0], ls->capacity[0]);
+        release_buffer(ls->groups[1], ls->capacity[1]);
+        fs->buffer = NULL;
+        close_stream(fs);
+        return NULL;
+    }
+    return ls;
 }
-/*
 
-*/
-// unit test branch labels.
-uint8_t *fs_read(file_stream *fs, size_t desired, size_t *result)
+int64_t ls_append(log_stream *ls, const uint8_t *data, size_t size)
 {
     /*
-        This acts more as an allocator then a copy based data stream.
-        Hand you a pointer to the start of your data.
+        Add a record to the log. Returns its commit ticket,
+        or -1 with errno set when the log failed.
     */
-    uint8_t *res = NULL;
-    *result = desired;
-    if ((desired + fs->buffer_ptr) > fs->file_ptr) {
-        /*
-            Our buffer has reached its very end.
-        */
-        if (fs->file_ptr == fs->file_size) {
-            // We have nothing yet to read from the actual file on disk.
-            size_t rem_size = fs->file_size - fs->buffer_ptr;
-            if (rem_size < desired) {
-                // if there is something left to be fetched form the buffer
-                // we correct the desired size.
-                *result = rem_size;
-                if (rem_size == 0) {
-                    // well, we are completely empty
-                    return 0;
-                }
-            }
-        } else {
-            if (sync_stream_read(fs, desired) == 0) {
-                return 0;
+    file_stream *fs = &ls->base.animal;
+    pthread_mutex_lock(&ls->lock);
+    size_t pending = 0;
+    for (;;) {
+        if (ls->error) {
+            errno = ls->error;
+            pthread_mutex_unlock(&ls->lock);
+            return -1;
+        }
+        pending = fs->buffer_ptr - fs->file_ptr;
+        if (pending + size <= ls->capacity[ls->open]) {
+            break;
+        }
+        if (pending == 0) {
+            // a record larger than the group, only the open one grows
+            size_t capacity = next_page_multiple(size);
+            uint8_t *group = alloc_buffer(capacity);
+            if (group == NULL) {
+                pthread_mutex_unlock(&ls->lock);
+                errno = ENOMEM;
+                return -1;
             }
+            release_buffer(ls->groups[ls->open], ls->capacity[ls->open]);
+            ls->groups[ls->open] = group;
+            ls->capacity[ls->open] = capacity;
+            fs->buffer = group;
+            break;
         }
+        ls->blocked++;
+        pthread_cond_signal(&ls->wake);
+        pthread_cond_wait(&ls->done, &ls->lock);
+        ls->blocked--;
+    }
+    if (pending == 0) {
+        ls->opened = log_now();
+    }
+    memcpy(&fs->buffer[pending], data, size);
+    fs->buffer_ptr += size;
+    int64_t ticket = fs->buffer_ptr;
+    if (pending == 0 || pending + size >= ls->window_size) {
+        pthread_cond_signal(&ls->wake);
     }
+    pthread_mutex_unlock(&ls->lock);
+    return ticket;
+}
 
-    // otherwise, jsut grab the value from the buffer
-    res = &fs->buffer[(fs->buffer_ptr + fs->buffer_size) - fs->file_ptr];
-    fs->buffer_ptr += *result;
+int32_t ls_commit(log_stream *ls, int64_t ticket)
+{
+    /*
+        Wait until the log is synced past ticket. A negative ticket
+        commits everything appended so far.
+        Returns -1 with errno set when the log failed before that.
+    */
+    file_stream *fs = &ls->base.animal;
+    pthread_mutex_lock(&ls->lock);
+    size_t target = fs->buffer_ptr;
+    if (ticket >= 0 && (size_t)ticket < target) {
+        target = ticket;
+    }
+    while (ls->durable < target && !ls->error) {
+        pthread_cond_wait(&ls->done, &ls->lock);
+    }
+    int32_t res = 0;
+    if (ls->durable < target) {
+        errno = ls->error;
+        res = -1;
+    }
+    pthread_mutex_unlock(&ls->lock);
     return res;
 }
 
-uint8_t *fs_write(file_stream *fs, size_t sm)
+int32_t ls_close(log_stream *ls)
 {
     /*
-        This acts more as an allocator then a copy based data stream.
-        Hand you a pointer to the start of your data.
+        Commits what is pending. Returns -1 with errno set
+        when any of the log failed to reach the disk.
     */
-    if ((sm + fs->buffer_ptr) > (fs->file_ptr + fs->buffer_size)) {
-        /*
-            Our buffer has reached its very end.
-        */
-        if (sync_stream_write(fs, sm) == 0) {
-            return 0;
-        }
+    if (ls == NULL) {
+        return 0;
+    }
+    file_stream *fs = &ls->base.animal;
+    pthread_mutex_lock(&ls->lock);
+    ls->exit = 1;
+    pthread_cond_signal(&ls->wake);
+    pthread_mutex_unlock(&ls->lock);
+    pthread_join(ls->thread, NULL);
+    pthread_cond_destroy(&ls->done);
+    pthread_cond_destroy(&ls->wake);
+    pthread_mutex_destroy(&ls->lock);
+    release_buffer(ls->groups[0], ls->capacity[0]);
+    release_buffer(ls->groups[1], ls->capacity[1]);
+    int32_t error = ls->error;
+    // the flusher wrote everything, there is nothing left to flush
+    fs->buffer = NULL;
+    fs->buffer_ptr = fs->file_ptr;
+    int32_t res = close_stream(fs);
+    if (error) {
+        errno = error;
+        return -1;
     }
+    return res;
+}
 
-    // otherwise, jsut grab the value from the buffer
-    uint8_t *res = &fs->buffer[fs->buffer_ptr - fs->file_ptr];
-    fs->buffer_ptr += sm;
+#define SEGMENT_RETIRE_SLOTS 4
+
+/*
+    Segment streams.
+    A segment stream writes a sequence of files, p.000000, p.000001 and
+    so on, and moves to the next one before a write would take the
+    current one past segment_size. A helper thread opens and preallocates
+    the next segment ahead of time, and flushes, syncs and closes the
+    full ones, so a switch only swaps two stream pointers on the writer's
+    thread. The writer waits only when the helper is SEGMENT_RETIRE_SLOTS
+    segments behind. Writes never straddle segments. A write larger than
+    segment_size gets a segment to itself.
+*/
+typedef struct segment_stream_t
+{
+    // the writer only touches current
+    file_stream *current;
+    uint32_t segment;
+    size_t segment_size;
+    char mode[16];
+    // p and room for the segment suffix, only the helper uses it
+    char *path;
+    size_t path_len;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    // opened ahead, and a ring of full ones waiting to be closed
+    file_stream *next;
+    file_stream *retired[SEGMENT_RETIRE_SLOTS];
+    uint32_t retire_head;
+    uint32_t retire_count;
+    int32_t exit;
+    // the first error we could not report yet
+    int32_t error;
+    // the first segment that failed to retire, ss_close reports it
+    int32_t retire_error;
+} segment_stream;
+
+// a dot, up to ten digits and the terminator
+#define SEGMENT_SUFFIX 12
+
+static char *segment_path(segment_stream *ss, uint32_t segment)
+{
+    snprintf(&ss->path[ss->path_len], SEGMENT_SUFFIX, ".%06u", segment);
+    return ss->path;
+}
+
+static file_stream *segment_create(segment_stream *ss, uint32_t segment)
+{
+    // closed segments are handed to readers
+    char *path = segment_path(ss, segment);
+    file_stream *fs =
+        open_stream(sizeof(file_stream), path, ss->mode, SHARED_FILE_MODE);
+#if defined(LINUX)
+    if (fs != NULL) {
+        // reserve the blocks without growing the file,
+        // the retire trims what we did not use.
+        fallocate(fs->fd, FALLOC_FL_KEEP_SIZE, 0, ss->segment_size);
+    }
+#endif
+    return fs;
+}
+
+static int32_t segment_retire(file_stream *fs)
+{
+    /*
+        Flush a full segment, trim it to what was written,
+        and sync and close it.
+    */
+    int32_t res = fs_flush(fs);
+    size_t size = fs->file_size;
+    if (res == 0 && !(fs->mode & MAPPED)) {
+        struct stat stats;
+        res = fstat(fs->fd, &stats);
+        size = stats.st_size;
+    }
+    if (res == 0 && ftruncate(fs->fd, size) == -1) {
+        res = -1;
+    }
+    if (res == 0 && fsync(fs->fd) == -1) {
+        res = -1;
+    }
+    int32_t error = errno;
+    if (close_stream(fs) == -1 && res == 0) {
+        res = -1;
+        error = errno;
+    }
+    errno = error;
     return res;
 }
 
-declare_delim(fs_read_line_8, 1, is_eol_8);
-declare_delim(fs_read_line_16, 2, is_eol_16);
-declare_delim(fs_read_line_32, 4, is_eol_32);
-size_t fs_read_line(file_stream *fs, uint8_t **line_start, file_stream_type st)
+static void *segment_main(void *arg)
 {
-    switch (st) {
-    case ASCII: {
-        return fs_read_line_8(fs, line_start, 1);
+    /*
+        Keep the next segment ready first, the writer may be waiting
+        for it. Then close what the writer left behind, in order.
+    */
+    segment_stream *ss = (segment_stream *)arg;
+    pthread_mutex_lock(&ss->lock);
+    for (;;) {
+        if (ss->next == NULL && !ss->exit && !ss->error) {
+            uint32_t segment = ss->segment + 1;
+            pthread_mutex_unlock(&ss->lock);
+            file_stream *fs = segment_create(ss, segment);
+            int32_t error = fs == NULL ? errno : 0;
+            pthread_mutex_lock(&ss->lock);
+            if (fs == NULL) {
+                ss->error = error;
+            }
+            ss->next = fs;
+            pthread_cond_broadcast(&ss->cond);
+        } else if (ss->retire_count > 0) {
+            file_stream *fs = ss->retired[ss->retire_head];
+            pthread_mutex_unlock(&ss->lock);
+            int32_t error = segment_retire(fs) == -1 ? errno : 0;
+            pthread_mutex_lock(&ss->lock);
+            if (error && !ss->error) {
+                ss->error = error;
+            }
+            if (error && !ss->retire_error) {
+                ss->retire_error = error;
+            }
+            ss->retire_head = (ss->retire_head + 1) % SEGMENT_RETIRE_SLOTS;
+            ss->retire_count--;
+            pthread_cond_broadcast(&ss->cond);
+        } else if (ss->exit) {
+            break;
+        } else {
+            pthread_cond_wait(&ss->cond, &ss->lock);
+        }
     }
-    case UNICODE_16: {
-        return fs_read_line_16(fs, line_start, 1);
+    pthread_mutex_unlock(&ss->lock);
+    return NULL;
+}
+
+static int32_t segment_roll(segment_stream *ss)
+{
+    /*
+        Swap in the segment the helper opened, and hand it the full one.
+        We only wait when the helper is behind.
+    */
+    pthread_mutex_lock(&ss->lock);
+    while ((ss->next == NULL || ss->retire_count == SEGMENT_RETIRE_SLOTS) &&
+           !ss->error) {
+        pthread_cond_wait(&ss->cond, &ss->lock);
     }
-    default: {
-        return fs_read_line_32(fs, line_start, 1);
+    if (ss->error) {
+        errno = ss->error;
+        ss->error = 0;
+        // the helper may try again
+        pthread_cond_signal(&ss->cond);
+        pthread_mutex_unlock(&ss->lock);
+        return -1;
+    }
+    uint32_t slot = (ss->retire_head + ss->retire_count) % SEGMENT_RETIRE_SLOTS;
+    ss->retired[slot] = ss->current;
+    ss->retire_count++;
+    ss->current = ss->next;
+    ss->next = NULL;
+    ss->segment++;
+    pthread_cond_signal(&ss->cond);
+    pthread_mutex_unlock(&ss->lock);
+    return 0;
+}
+
+segment_stream *ss_open(const char *p, char *mode, size_t segment_size)
+{
+    /*
+        Segments are opened with mode, which has to be a "w" mode.
+    */
+    size_t len = strlen(mode);
+    if (mode[0] != 'w' || strchr(mode, '+') != NULL || segment_size == 0 ||
+        len >= sizeof(((segment_stream *)0)->mode)) {
+        return NULL;
+    }
+    segment_stream *ss = (segment_stream *)calloc(1, sizeof(segment_stream));
+    if (ss == NULL) {
+        return NULL;
+    }
+    memcpy(ss->mode, mode, len + 1);
+    ss->segment_size = segment_size;
+    ss->path_len = strlen(p);
+    ss->path = (char *)malloc(ss->path_len + SEGMENT_SUFFIX);
+    if (ss->path == NULL) {
+        free(ss);
+        return NULL;
     }
+    memcpy(ss->path, p, ss->path_len);
+    ss->current = segment_create(ss, 0);
+    if (ss->current == NULL) {
+        free(ss->path);
+        free(ss);
+        return NULL;
+    }
+    pthread_mutex_init(&ss->lock, NULL);
+    pthread_cond_init(&ss->cond, NULL);
+    if (pthread_create(&ss->thread, NULL, segment_main, ss) != 0) {
+        pthread_cond_destroy(&ss->cond);
+        pthread_mutex_destroy(&ss->lock);
+        close_stream(ss->current);
+        free(ss->path);
+        free(ss);
+        return NULL;
     }
+    return ss;
 }
 
-declare_delim(fs_get_delim_8, 1, from_char_8);
-declare_delim(fs_get_delim_16, 2, from_char_16);
-declare_delim(fs_get_delim_32, 4, from_char_32);
-size_t fs_get_delim(file_stream *fs, uint8_t **line_start, int32_t delim,
-                    file_stream_type st)
+uint8_t *ss_write(segment_stream *ss, size_t sm)
 {
-    switch (st) {
-    case ASCII: {
-        return fs_get_delim_8(fs, line_start, delim);
+    /*
+        Room for sm bytes in the current segment, as fs_write.
+        Returns NULL with errno set when a segment failed.
+    */
+    file_stream *fs = ss->current;
+    if (fs->buffer_ptr > 0 && fs->buffer_ptr + sm > ss->segment_size) {
+        if (segment_roll(ss) == -1) {
+            return NULL;
+        }
+        fs = ss->current;
     }
-    case UNICODE_16: {
-        return fs_get_delim_16(fs, line_start, delim);
+    return fs_write(fs, sm);
+}
+
+int32_t ss_close(segment_stream *ss)
+{
+    /*
+        Close the current segment and drop the one opened ahead.
+        Returns -1 with errno set when any segment failed.
+    */
+    if (ss == NULL) {
+        return 0;
     }
-    default: {
-        return fs_get_delim_32(fs, line_start, delim);
+    pthread_mutex_lock(&ss->lock);
+    ss->exit = 1;
+    pthread_cond_signal(&ss->cond);
+    pthread_mutex_unlock(&ss->lock);
+    pthread_join(ss->thread, NULL);
+    pthread_cond_destroy(&ss->cond);
+    pthread_mutex_destroy(&ss->lock);
+    // a lost segment stays an error, even once a roll reported it
+    int32_t error = ss->retire_error ? ss->retire_error : ss->error;
+    if (ss->next) {
+        close_stream(ss->next);
+        unlink(segment_path(ss, ss->segment + 1));
+    }
+    if (segment_retire(ss->current) == -1 && !error) {
+        error = errno;
     }
+    free(ss->path);
+    free(ss);
+    if (error) {
+        errno = error;
+        return -1;
     }
+    return 0;
 }
 
-int64_t fs_tell(file_stream *fs) { return fs->buffer_ptr; }
+/*
+    Append streams.
+    An append stream lets any number of threads add to the end of one
+    file with no lock around their writes. Every thread fills its own
+    appender, and publishing it reserves the next range of the file with
+    one atomic add and writes it there with pwrite. The writes run in
+    parallel and can finish out of order. as_published is the end below
+    which every range is in the file, it only moves forward once every
+    range before it is written. Tail the file up to there, its size can
+    run ahead over ranges still in flight. A range that failed stops the
+    published end for good.
+*/
+typedef struct fs_appender_t
+{
+    uint8_t *buffer;
+    size_t size;
+    size_t capacity;
+} fs_appender;
 
-bit_stream *bs_open(const char *p, char *mode)
+typedef struct append_range_t
 {
-    bit_stream *bs = (bit_stream *)create_stream(sizeof(bit_stream), p, mode);
-    bs->mask = 0;
-    bs->part = 0;
-    return bs;
+    size_t offset;
+    size_t end;
+} append_range;
+
+typedef struct append_stream_t
+{
+    union // C inheritance trick
+    {
+        file_stream animal;
+    } base;
+    // the next range starts here, file_size of the base is published
+    size_t tail;
+    // written ranges past the published end, by offset
+    pthread_mutex_t lock;
+    append_range *pending;
+    uint32_t pending_count;
+    uint32_t pending_capacity;
+    int32_t error;
+} append_stream;
+
+int32_t fs_appender_init(fs_appender *w, size_t capacity)
+{
+    w->capacity = next_page_multiple(MAX(capacity, 1));
+    w->buffer = alloc_buffer(w->capacity);
+    w->size = 0;
+    return w->buffer ? 0 : -1;
 }
 
-uint8_t bs_write(bit_stream *bs, int bit)
+void fs_appender_release(fs_appender *w)
 {
-    if (bit) {
-        bs->part |= bs->mask;
-    }
+    release_buffer(w->buffer, w->capacity);
+    w->buffer = NULL;
+    w->size = 0;
+    w->capacity = 0;
+}
 
-    bs->mask = bs->mask >> 1;
-    if (bs->mask == 0) {
-        *(uint64_t *)fs_write((file_stream *)bs, sizeof(uint64_t)) = bs->part;
-        bs->part = 0;
-        bs->mask = partmask;
-        return 1;
+static int32_t append_publish(append_stream *as, size_t offset, size_t end)
+{
+    /*
+        Move the published end over a written range and every pending
+        range it joins up with, or keep it pending until it does.
+    */
+    file_stream *fs = &as->base.animal;
+    pthread_mutex_lock(&as->lock);
+    if (offset == fs->file_size) {
+        uint32_t joined = 0;
+        while (joined < as->pending_count &&
+               as->pending[joined].offset == end) {
+            end = as->pending[joined++].end;
+        }
+        if (joined > 0) {
+            as->pending_count -= joined;
+            memmove(as->pending, &as->pending[joined],
+                    as->pending_count * sizeof(append_range));
+        }
+        __atomic_store_n(&fs->file_size, end, __ATOMIC_RELEASE);
+        stream_touch(fs);
+    } else {
+        if (as->pending_count == as->pending_capacity) {
+            uint32_t capacity = MAX(as->pending_capacity * 2, 16);
+            append_range *pending = (append_range *)realloc(
+                as->pending, capacity * sizeof(append_range));
+            if (pending == NULL) {
+                // we can not remember it, the published end stops here
+                as->error = ENOMEM;
+                pthread_mutex_unlock(&as->lock);
+                errno = ENOMEM;
+                return -1;
+            }
+            as->pending = pending;
+            as->pending_capacity = capacity;
+        }
+        uint32_t i = as->pending_count;
+        while (i > 0 && as->pending[i - 1].offset > offset) {
+            as->pending[i] = as->pending[i - 1];
+            i--;
+        }
+        as->pending[i].offset = offset;
+        as->pending[i].end = end;
+        as->pending_count++;
     }
+    pthread_mutex_unlock(&as->lock);
     return 0;
 }
 
-uint32_t bs_read(bit_stream *bs)
+append_stream *as_open(const char *p, char *mode)
 {
-    int result = 0;
-    if (bs->mask == partmask) {
-        size_t expected = 0;
-        bs->part = *(uint64_t *)fs_read((file_stream *)bs, sizeof(uint64_t),
-                                        &expected);
+    /*
+        Open p for appending, "w" starts it empty and "a" continues it.
+    */
+    if ((mode[0] != 'w' && mode[0] != 'a') || mode[1] != '\0') {
+        return NULL;
     }
-    result = bs->part & bs->mask;
-    bs->mask = bs->mask >> 1;
-    if (bs->mask == 0) {
-        bs->mask = partmask;
+    // readers follow what is published, so they must open it
+    append_stream *as = (append_stream *)open_stream(
+        sizeof(append_stream), p, mode, SHARED_FILE_MODE);
+    if (as == NULL) {
+        return NULL;
     }
-    return result;
+    file_stream *fs = &as->base.animal;
+    // the appenders replace the stream buffer
+    release_buffer(fs->buffer, fs->buffer_capacity);
+    fs->buffer = NULL;
+    fs->buffer_capacity = 0;
+    fs->file_ptr = fs->file_size;
+    fs->buffer_ptr = fs->file_size;
+    as->tail = fs->file_size;
+    as->pending = NULL;
+    as->pending_count = 0;
+    as->pending_capacity = 0;
+    as->error = 0;
+    pthread_mutex_init(&as->lock, NULL);
+    return as;
+}
+
+int32_t as_flush(append_stream *as, fs_appender *w)
+{
+    /*
+        Publish what the appender holds at the end of the file.
+        Returns -1 with errno set when the write failed.
+    */
+    if (w->size == 0) {
+        return 0;
+    }
+    file_stream *fs = &as->base.animal;
+    size_t offset = __atomic_fetch_add(&as->tail, w->size, __ATOMIC_RELAXED);
+    size_t done = 0;
+    while (done < w->size) {
+        ssize_t opres =
+            fs_sys_pwrite(fs, &w->buffer[done], w->size - done, offset + done);
+        if (opres == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            int32_t error = errno;
+            pthread_mutex_lock(&as->lock);
+            if (!as->error) {
+                as->error = error;
+            }
+            pthread_mutex_unlock(&as->lock);
+            w->size = 0;
+            errno = error;
+            return -1;
+        }
+        done += opres;
+    }
+    w->size = 0;
+    return append_publish(as, offset, offset + done);
+}
+
+uint8_t *as_write(append_stream *as, fs_appender *w, size_t sm)
+{
+    /*
+        Room for sm bytes in the appender, as fs_write. A full appender
+        is published first, so records never straddle two ranges.
+    */
+    if (w->size + sm > w->capacity) {
+        if (as_flush(as, w) == -1) {
+            return NULL;
+        }
+        if (sm > w->capacity) {
+            fs_appender_release(w);
+            if (fs_appender_init(w, sm) == -1) {
+                return NULL;
+            }
+        }
+    }
+    uint8_t *res = &w->buffer[w->size];
+    w->size += sm;
+    return res;
+}
+
+size_t as_published(append_stream *as)
+{
+    return __atomic_load_n(&as->base.animal.file_size, __ATOMIC_ACQUIRE);
+}
+
+int32_t as_close(append_stream *as)
+{
+    /*
+        Every appender has to be published or dropped before.
+        Returns -1 with errno set when any range failed.
+    */
+    if (as == NULL) {
+        return 0;
+    }
+    int32_t error = as->error;
+    pthread_mutex_destroy(&as->lock);
+    free(as->pending);
+    int32_t res = close_stream((file_stream *)as);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return res;
 }
 
 #endif // _CSTREAM_H
\ No newline at end of file
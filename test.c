@@ -10,6 +10,7 @@
 #include <stdarg.h>
 #include <sys/ioctl.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #endif
 
@@ -135,6 +136,77 @@ int file_read_line(FILE *fd, char *buff, size_t s)
     return getline(&buff, &s, fd) != -1;
 }
 
+void count_line(void *ctx, uint32_t worker, uint8_t *line, size_t len)
+{
+    ((size_t *)ctx)[worker % 64] += len;
+}
+
+declare_record_reader(read_u64, uint64_t);
+
+#define LOG_RECORDS 256
+#define LOG_THREADS 4
+
+void *log_append_commit(void *arg)
+{
+    uint8_t record[128] = {0};
+    for (int i = 0; i < LOG_RECORDS / LOG_THREADS; i++) {
+        ls_commit((log_stream *)arg,
+                  ls_append((log_stream *)arg, record, sizeof(record)));
+    }
+    return NULL;
+}
+
+#define SHARED_RECORDS (1 << 20)
+#define SHARED_THREADS 8
+
+typedef struct shared_writer_t
+{
+    file_stream *fs;
+    pthread_mutex_t lock;
+} shared_writer;
+
+void *locked_write8(void *arg)
+{
+    shared_writer *sw = (shared_writer *)arg;
+    for (uint64_t i = 0; i < SHARED_RECORDS / SHARED_THREADS; i++) {
+        pthread_mutex_lock(&sw->lock);
+        *(uint64_t *)fs_write(sw->fs, 8) = i;
+        pthread_mutex_unlock(&sw->lock);
+    }
+    return NULL;
+}
+
+void *append_write8(void *arg)
+{
+    fs_appender w;
+    fs_appender_init(&w, alloc_size);
+    for (uint64_t i = 0; i < SHARED_RECORDS / SHARED_THREADS; i++) {
+        *(uint64_t *)as_write((append_stream *)arg, &w, 8) = i;
+    }
+    as_flush((append_stream *)arg, &w);
+    fs_appender_release(&w);
+    return NULL;
+}
+
+void *drain_pipe(void *arg)
+{
+    char buffer[1 << 16];
+    while (read(*(int *)arg, buffer, sizeof(buffer)) > 0) {
+    }
+    return NULL;
+}
+
+void run_writers(void *(*writer)(void *), void *arg)
+{
+    pthread_t writers[SHARED_THREADS];
+    for (int i = 0; i < SHARED_THREADS; i++) {
+        pthread_create(&writers[i], NULL, writer, arg);
+    }
+    for (int i = 0; i < SHARED_THREADS; i++) {
+        pthread_join(writers[i], NULL);
+    }
+}
+
 void gen_test_file(char *filename, ssize_t size)
 {
     int32_t nr_lines = size / 128;
@@ -147,23 +219,266 @@ void gen_test_file(char *filename, ssize_t size)
     }
     fclose(f);
 }
+typedef struct test_file_t
+{
+    char *name;
+    ssize_t size;
+} test_file;
+
+test_file test_files[] = {
+    {"test_1k.txt", 1024},
+    {"test_4k.txt", 1024 * 4},
+    {"test_8k.txt", 1024 * 8},
+    {"test_32k.txt", 1024 * 32},
+    {"test_64k.txt", 1024 * 64},
+    {"test_128k.txt", 1024 * 128},
+    {"test_256k.txt", 1024 * 256},
+    {"test_512k.txt", 1024 * 512},
+    {"test_1m.txt", 1024 * 1024},
+    {"test_10m.txt", 1024 * 1024 * 10},
+    {"test_50m.txt", 1024 * 1024 * 50},
+    {"test_100m.txt", 1024 * 1024 * 100},
+};
+#define NR_TEST_FILES (sizeof(test_files) / sizeof(test_files[0]))
+
 void gen_test_files()
 {
-    gen_test_file("test_1k.txt", 1024);
-    gen_test_file("test_4k.txt", 1024 * 4);
-    gen_test_file("test_8k.txt", 1024 * 8);
-    gen_test_file("test_32k.txt", 1024 * 32);
-    gen_test_file("test_64k.txt", 1024 * 64);
-    gen_test_file("test_128k.txt", 1024 * 128);
-    gen_test_file("test_256k.txt", 1024 * 256);
-    gen_test_file("test_512k.txt", 1024 * 512);
-    gen_test_file("test_1m.txt", 1024 * 1024);
-    gen_test_file("test_10m.txt", 1024 * 1024 * 10);
-    gen_test_file("test_50m.txt", 1024 * 1024 * 50);
-    gen_test_file("test_100m.txt", 1024 * 1024 * 100);
+    for (size_t i = 0; i < NR_TEST_FILES; i++) {
+        gen_test_file(test_files[i].name, test_files[i].size);
+    }
 }
-int main()
+
+/*
+    The benchmark matrix.
+    Every reader runs over every test file, warm and with a cold page
+    cache, and reports median and p99 throughput as JSON.
+
+        ./test bench [trials] [name filter]
+*/
+#define BENCH_LINE 0
+#define BENCH_DELIM ((size_t)-1)
+#define BENCH_BLOCK ((size_t)-2)
+
+typedef uint64_t (*bench_fn)(const char *path, const char *mode, size_t unit);
+
+typedef struct bench_case_t
+{
+    const char *name;
+    const char *mode;
+    size_t unit;
+    bench_fn fn;
+} bench_case;
+
+uint64_t bench_stream(const char *path, const char *mode, size_t unit)
+{
+    file_stream *fs = fs_open(path, (char *)mode);
+    uint64_t sum = 0;
+    uint8_t *res = NULL;
+    size_t len = 0;
+    if (unit == BENCH_LINE) {
+        while ((len = fs_read_line(fs, &res, ASCII)) != 0) {
+            sum += res[len - 1];
+        }
+    } else if (unit == BENCH_DELIM) {
+        while ((len = fs_get_delim(fs, &res, ' ', ASCII)) != 0) {
+            sum += res[len - 1];
+        }
+    } else {
+        while ((res = fs_read(fs, unit, &len)) != NULL) {
+            sum += res[len - 1];
+        }
+    }
+    close_stream(fs);
+    return sum;
+}
+
+uint64_t bench_stdio(const char *path, const char *mode, size_t unit)
+{
+    FILE *f = fopen(path, "rb");
+    uint64_t sum = 0;
+    if (unit == BENCH_LINE) {
+        char *line = NULL;
+        size_t cap = 0;
+        ssize_t len = 0;
+        while ((len = getline(&line, &cap, f)) != -1) {
+            sum += line[len - 1];
+        }
+        free(line);
+    } else {
+        uint8_t buff[128];
+        while (fread(buff, unit, 1, f) == 1) {
+            sum += buff[unit - 1];
+        }
+    }
+    fclose(f);
+    return sum;
+}
+
+uint64_t bench_raw_read(const char *path, const char *mode, size_t unit)
 {
+    int fd = open(path, O_RDONLY);
+    uint8_t *buff = (uint8_t *)malloc(alloc_size);
+    uint64_t sum = 0;
+    ssize_t len = 0;
+    while ((len = read(fd, buff, alloc_size)) > 0) {
+        sum += buff[len - 1];
+    }
+    free(buff);
+    close(fd);
+    return sum;
+}
+
+uint64_t bench_mmap(const char *path, const char *mode, size_t unit)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat stats;
+    fstat(fd, &stats);
+    uint64_t sum = 0;
+    uint8_t *m = (uint8_t *)mmap(NULL, stats.st_size, PROT_READ, MAP_PRIVATE,
+                                 fd, 0);
+    if (m != MAP_FAILED) {
+        madvise(m, stats.st_size, MADV_SEQUENTIAL);
+        for (off_t i = 0; i + 8 <= stats.st_size; i += 8) {
+            sum += *(uint64_t *)&m[i];
+        }
+        munmap(m, stats.st_size);
+    }
+    close(fd);
+    return sum;
+}
+
+bench_case bench_cases[] = {
+    {"fs_read", "r", 1, bench_stream},
+    {"fs_read", "r", 6, bench_stream},
+    {"fs_read", "r", 8, bench_stream},
+    {"fs_read", "r", 64, bench_stream},
+    {"fs_read", "r", 128, bench_stream},
+    {"fs_read_line", "r", BENCH_LINE, bench_stream},
+    {"fs_get_delim", "r", BENCH_DELIM, bench_stream},
+    {"fs_read", "rm", 1, bench_stream},
+    {"fs_read", "rm", 8, bench_stream},
+    {"fs_read", "rm", 128, bench_stream},
+    {"fs_read_line", "rm", BENCH_LINE, bench_stream},
+    {"fs_read", "rp", 8, bench_stream},
+    {"fs_read", "rp", 128, bench_stream},
+    {"fs_read_line", "rp", BENCH_LINE, bench_stream},
+    {"fread", "", 1, bench_stdio},
+    {"fread", "", 6, bench_stdio},
+    {"fread", "", 8, bench_stdio},
+    {"fread", "", 64, bench_stdio},
+    {"fread", "", 128, bench_stdio},
+    {"getline", "", BENCH_LINE, bench_stdio},
+    {"read", "", BENCH_BLOCK, bench_raw_read},
+    {"mmap", "", BENCH_BLOCK, bench_mmap},
+};
+#define NR_BENCH_CASES (sizeof(bench_cases) / sizeof(bench_cases[0]))
+
+void bench_drop_cache(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+void bench_ensure_file(test_file *tf)
+{
+    struct stat stats;
+    if (stat(tf->name, &stats) == 0 && stats.st_size == tf->size) {
+        return;
+    }
+    gen_test_file(tf->name, tf->size);
+    bench_drop_cache(tf->name);
+}
+
+double bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int bench_cmp(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+const char *bench_unit(size_t unit, char *buff)
+{
+    if (unit == BENCH_LINE) {
+        return "line";
+    }
+    if (unit == BENCH_DELIM) {
+        return "delim";
+    }
+    if (unit == BENCH_BLOCK) {
+        return "block";
+    }
+    sprintf(buff, "%zu", unit);
+    return buff;
+}
+
+volatile uint64_t bench_sink = 0;
+
+int run_bench(int trials, const char *filter)
+{
+    double *ns = (double *)malloc(sizeof(double) * trials);
+    int first = 1;
+    printf("{\"trials\": %d, \"results\": [\n", trials);
+    for (size_t f = 0; f < NR_TEST_FILES; f++) {
+        test_file *tf = &test_files[f];
+        bench_ensure_file(tf);
+        for (size_t c = 0; c < NR_BENCH_CASES; c++) {
+            bench_case *bc = &bench_cases[c];
+            if (filter && strstr(bc->name, filter) == NULL) {
+                continue;
+            }
+            for (int cold = 0; cold < 2; cold++) {
+                if (!cold) {
+                    // warm up the page cache and our pool
+                    bench_sink += bc->fn(tf->name, bc->mode, bc->unit);
+                }
+                for (int t = 0; t < trials; t++) {
+                    if (cold) {
+                        bench_drop_cache(tf->name);
+                    }
+                    double start = bench_now();
+                    bench_sink += bc->fn(tf->name, bc->mode, bc->unit);
+                    ns[t] = bench_now() - start;
+                }
+                qsort(ns, trials, sizeof(double), bench_cmp);
+                double median = ns[trials / 2];
+                // nearest rank, the slow tail
+                double p99 = ns[(trials * 99 + 99) / 100 - 1];
+                double mb = (double)tf->size / (1024 * 1024);
+                char ub[32];
+                printf("%s  {\"file\": \"%s\", \"size\": %zd, "
+                       "\"method\": \"%s\", \"mode\": \"%s\", "
+                       "\"unit\": \"%s\", \"cache\": \"%s\", "
+                       "\"median_ns\": %.0f, \"p99_ns\": %.0f, "
+                       "\"median_mbps\": %.2f, \"p99_mbps\": %.2f}",
+                       first ? "" : ",\n", tf->name, tf->size, bc->name,
+                       bc->mode, bench_unit(bc->unit, ub),
+                       cold ? "cold" : "warm", median, p99,
+                       mb / (median / 1e9), mb / (p99 / 1e9));
+                first = 0;
+                fflush(stdout);
+            }
+        }
+    }
+    printf("\n]}\n");
+    free(ns);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        int trials = argc > 2 ? atoi(argv[2]) : 11;
+        return run_bench(trials > 0 ? trials : 11, argc > 3 ? argv[3] : NULL);
+    }
     gen_test_file("test_10m.txt", 1024 * 1024 * 10);
     const char *test_file_path = "test_10m.txt"; // some 100 megabyte text file
 
@@ -196,6 +511,7 @@ int main()
     free(bu);
     close(fd);
 
+    char *line = 0;
     file_stream *fs = fs_open(test_file_path, "r");
     MEASURE_TIME(stream, file_stream_128bytes, {
         size_t expected = 128;
@@ -204,6 +520,39 @@ int main()
     });
     close_stream(fs);
 
+    fs = fs_open(test_file_path, "r");
+    fs_checksum(fs);
+    MEASURE_TIME(stream, file_stream_128bytes_checksum, {
+        size_t expected = 128;
+        while (fs_read(fs, 128, &expected) != NULL) {
+        }
+    });
+    size_t digest_size = 0;
+    uint32_t digest = fs_digest(fs, &digest_size);
+    close_stream(fs);
+
+    fs = fs_open(test_file_path, "r");
+    MEASURE_TIME(stream, file_stream_128bytes_crc_pass, {
+        size_t expected = 128;
+        uint8_t *res = NULL;
+        uint32_t crc = ~0u;
+        while ((res = fs_read(fs, 128, &expected)) != NULL) {
+            crc = scan_table.crc_32c(crc, res, expected);
+        }
+        if (~crc != digest) {
+            printf("digest mismatch %x %x\n", ~crc, digest);
+        }
+    });
+    close_stream(fs);
+
+    record_stream *rs = rs_open(test_file_path, "r", 128);
+    MEASURE_TIME(stream, record_stream_128bytes, {
+        size_t count = 0;
+        while (rs_read(rs, SIZE_MAX, &count) != NULL) {
+        }
+    });
+    rs_close(rs);
+
     fs = fs_open(test_file_path, "r");
     size_t expected = 8;
     MEASURE_TIME(stream, file_stream_8bytes, {
@@ -212,6 +561,27 @@ int main()
     });
     close_stream(fs);
 
+    rs = rs_open(test_file_path, "r", sizeof(uint64_t));
+    MEASURE_TIME(stream, record_stream_8bytes_typed, {
+        uint64_t *records;
+        size_t count = 0;
+        uint64_t sum = 0;
+        while ((records = read_u64(rs, SIZE_MAX, &count)) != NULL) {
+            for (size_t i = 0; i < count; i++) {
+                sum += records[i];
+            }
+        }
+    });
+    rs_close(rs);
+
+    fs = fs_open(test_file_path, "r");
+    fs_set_buffer_limit(fs, alloc_size);
+    MEASURE_TIME(stream, file_stream_8bytes_fixed, {
+        while (fs_read(fs, 8, &expected) != NULL) {
+        }
+    });
+    close_stream(fs);
+
     fs = fs_open(test_file_path, "r");
     expected = 6;
     MEASURE_TIME(stream, file_stream_6bytes, {
@@ -220,6 +590,53 @@ int main()
     });
     close_stream(fs);
 
+#if defined(CSTREAM_STATS)
+    fs = fs_open(test_file_path, "r");
+    MEASURE_TIME(stream, file_stream_6bytes_stats, {
+        while (fs_read(fs, 6, &expected) != NULL) {
+        }
+    });
+    fs_stats fstats;
+    fs_stats_snapshot(fs, &fstats);
+    printf("reads %lu (%lu short, %lu bytes), seeks %lu, rewinds %lu "
+           "(%lu bytes re-read), reallocs %lu\n",
+           fstats.calls[STATS_READ], fstats.short_reads,
+           fstats.bytes[STATS_READ], fstats.calls[STATS_SEEK], fstats.rewinds,
+           fstats.reread_bytes, fstats.reallocs);
+    close_stream(fs);
+#endif
+
+    fs = fs_open(test_file_path, "rp");
+    expected = 8;
+    MEASURE_TIME(stream, file_stream_read_ahead_8bytes, {
+        while (fs_read(fs, 8, &expected) != NULL) {
+        }
+    });
+    close_stream(fs);
+
+    fs = fs_open(test_file_path, "rd");
+    expected = 128;
+    MEASURE_TIME(stream, file_stream_direct_128bytes, {
+        while (fs_read(fs, 128, &expected) != NULL) {
+        }
+    });
+    close_stream(fs);
+
+    fs = fs_open(test_file_path, "rm");
+    expected = 8;
+    MEASURE_TIME(stream, file_stream_mapped_8bytes, {
+        while (fs_read(fs, 8, &expected) != NULL) {
+        }
+    });
+    close_stream(fs);
+
+    fs = fs_open(test_file_path, "rm");
+    MEASURE_TIME(stream, file_stream_mapped_read_line, {
+        while (fs_read_line(fs, (uint8_t **)&line, ASCII)) {
+        }
+    });
+    close_stream(fs);
+
     char buff[8];
     FILE *f = fopen(test_file_path, "rb");
     MEASURE_TIME(stream, file_read_8bytes, {
@@ -250,13 +667,27 @@ int main()
     fclose(f);
 
     fs = fs_open(test_file_path, "r");
-    char *line = 0;
+    line = 0;
     MEASURE_TIME(stream, file_stream_read_line, {
         while (fs_read_line(fs, (uint8_t **)&line, ASCII)) {
         }
     });
     close_stream(fs);
 
+    fs_set_scan_isa(SCAN_SCALAR);
+    fs = fs_open(test_file_path, "r");
+    MEASURE_TIME(stream, file_stream_read_line_scalar, {
+        while (fs_read_line(fs, (uint8_t **)&line, ASCII)) {
+        }
+    });
+    close_stream(fs);
+    fs_set_scan_isa(SCAN_AVX2);
+
+    size_t line_bytes[64] = {0};
+    MEASURE_TIME(stream, file_stream_read_line_parallel, {
+        fs_for_each_line(test_file_path, 0, count_line, line_bytes);
+    });
+
     char lbuff[1024];
     f = fopen(test_file_path, "rb");
     MEASURE_TIME(stream, file_read_line, {
@@ -265,6 +696,103 @@ int main()
     });
     fclose(f);
 
+    fs = fs_open(test_file_path, "r");
+    size_t fields = 0;
+    MEASURE_TIME(stream, file_stream_read_line_split, {
+        size_t len = 0;
+        uint8_t *res = NULL;
+        while ((len = fs_read_line(fs, &res, ASCII)) != 0) {
+            int32_t in_quote = 0;
+            fields++;
+            for (size_t i = 0; i < len; i++) {
+                if (res[i] == '"') {
+                    in_quote = !in_quote;
+                } else if (res[i] == ' ' && !in_quote) {
+                    fields++;
+                }
+            }
+        }
+    });
+    close_stream(fs);
+
+    csv_stream *cs = cs_open(test_file_path, "r", ' ', '"');
+    MEASURE_TIME(stream, csv_stream_read_row, {
+        csv_field *row = NULL;
+        size_t count = 0;
+        while ((count = cs_read_row(cs, &row)) != 0) {
+            fields += count;
+        }
+    });
+    cs_close(cs);
+    printf("fields %lu\n", fields);
+
+    int forward[2];
+    pthread_t drain;
+    pipe(forward);
+    pthread_create(&drain, NULL, drain_pipe, &forward[0]);
+    fs = fs_open(test_file_path, "r");
+    MEASURE_TIME(stream, file_stream_forward_lines_write, {
+        size_t line_nr = 0;
+        size_t len = 0;
+        uint8_t *res = NULL;
+        while ((len = fs_read_line(fs, &res, ASCII)) != 0) {
+            if (++line_nr % 16 != 0) {
+                write(forward[1], res, len);
+            }
+        }
+    });
+    close_stream(fs);
+    fs = fs_open(test_file_path, "r");
+    fs_sink sink;
+    fs_sink_init(&sink, forward[1]);
+    MEASURE_TIME(stream, file_stream_forward_lines_sink, {
+        size_t line_nr = 0;
+        size_t len = 0;
+        uint8_t *res = NULL;
+        while ((len = fs_read_line(fs, &res, ASCII)) != 0) {
+            if (++line_nr % 16 != 0) {
+                fs_sink_span(&sink, fs, res, len);
+            }
+        }
+        fs_sink_flush(&sink);
+    });
+    close_stream(fs);
+    close(forward[1]);
+    pthread_join(drain, NULL);
+    close(forward[0]);
+
+    fs = fs_open(test_file_path, "r");
+    MEASURE_TIME(stream, file_stream_index_lines,
+                 { fs_index_lines(fs, test_file_path); });
+    MEASURE_TIME(stream, file_stream_seek_line, {
+        for (uint64_t i = 0; i < 10000; i++) {
+            fs_seek_line(fs, (i * 7919) % fs->lines->lines);
+        }
+    });
+    close_stream(fs);
+
+    fs = fs_open(test_file_path, "r");
+    MEASURE_TIME(stream, file_stream_seek_read_128bytes, {
+        for (uint64_t i = 0; i < 10000; i++) {
+            fs_seek(fs, (i * 104729) % (fs->file_size - 128), SEEK_SET);
+            fs_read(fs, 128, &expected);
+        }
+    });
+    fs_advise(fs, ADVISE_SEQUENTIAL);
+    MEASURE_TIME(stream, file_stream_seek_read_128bytes_sequential, {
+        for (uint64_t i = 0; i < 10000; i++) {
+            fs_seek(fs, (i * 104729) % (fs->file_size - 128), SEEK_SET);
+            fs_read(fs, 128, &expected);
+        }
+    });
+    MEASURE_TIME(stream, file_stream_pread_128bytes, {
+        for (uint64_t i = 0; i < 10000; i++) {
+            fs_pread(fs, NULL, (i * 104729) % (fs->file_size - 128), 128,
+                     &expected);
+        }
+    });
+    close_stream(fs);
+
     fs = fs_open(test_file_path, "r");
     file_stream *ofs = fs_open("out.txt", "w");
     if(ofs == NULL)
@@ -282,6 +810,13 @@ int main()
     close_stream(ofs);
     close_stream(fs);
 
+    fs = fs_open(test_file_path, "r");
+    ofs = fs_open("out.txt", "w");
+    MEASURE_TIME(stream, file_stream_copy,
+                 { fs_copy(ofs, fs, fs->file_size); });
+    close_stream(ofs);
+    close_stream(fs);
+
     fd = open(test_file_path, O_RDONLY, S_IREAD);
     status = fstat(fd, &stats);
     int32_t num_bytes = stats.st_size;
@@ -299,6 +834,20 @@ int main()
         }
     });
     close_stream(ofs);
+    ofs = fs_open("out.txt", "wb");
+    MEASURE_TIME(stream, file_stream_write8_behind, {
+        for (int i = 0; i < num_bytes; i += 8) {
+            (*(uint64_t *)fs_write(ofs, 8)) = *(uint64_t *)(char *)(bu + i);
+        }
+    });
+    close_stream(ofs);
+    ofs = fs_open("out.txt", "wm");
+    MEASURE_TIME(stream, file_stream_write8_mapped, {
+        for (int i = 0; i < num_bytes; i += 8) {
+            (*(uint64_t *)fs_write(ofs, 8)) = *(uint64_t *)(char *)(bu + i);
+        }
+    });
+    close_stream(ofs);
     ofs = fs_open("out.txt", "w");
     MEASURE_TIME(stream, file_stream_write6, {
         for (int i = 0; i < num_bytes; i += 6) {
@@ -306,8 +855,96 @@ int main()
         }
     });
     close_stream(ofs);
+    const size_t segment_bytes = 1 << 20;
+    ofs = fs_open("out.txt", "w");
+    MEASURE_TIME(stream, file_stream_write8_rotate, {
+        for (int i = 0; i < num_bytes; i += 8) {
+            if (ofs->buffer_ptr + 8 > segment_bytes) {
+                fs_flush(ofs);
+                fsync(ofs->fd);
+                close_stream(ofs);
+                ofs = fs_open("out.txt", "w");
+            }
+            (*(uint64_t *)fs_write(ofs, 8)) = *(uint64_t *)(char *)(bu + i);
+        }
+    });
+    close_stream(ofs);
+    segment_stream *ss = ss_open("out.txt", "w", segment_bytes);
+    MEASURE_TIME(stream, segment_stream_write8, {
+        for (int i = 0; i < num_bytes; i += 8) {
+            (*(uint64_t *)ss_write(ss, 8)) = *(uint64_t *)(char *)(bu + i);
+        }
+    });
+    ss_close(ss);
     free(bu);
 
+    ofs = fs_open("log.txt", "w");
+    MEASURE_TIME(stream, file_stream_append_fsync, {
+        for (int i = 0; i < LOG_RECORDS; i++) {
+            memset(fs_write(ofs, 128), 0, 128);
+            fs_flush(ofs);
+            fsync(ofs->fd);
+        }
+    });
+    close_stream(ofs);
+    log_stream *ls = ls_open("log.txt", "w", 0, 0);
+    MEASURE_TIME(stream, log_stream_group_commit, {
+        pthread_t appenders[LOG_THREADS];
+        for (int i = 0; i < LOG_THREADS; i++) {
+            pthread_create(&appenders[i], NULL, log_append_commit, ls);
+        }
+        for (int i = 0; i < LOG_THREADS; i++) {
+            pthread_join(appenders[i], NULL);
+        }
+    });
+    ls_close(ls);
+
+    shared_writer sw = {fs_open("out.txt", "w"), PTHREAD_MUTEX_INITIALIZER};
+    MEASURE_TIME(stream, file_stream_write8_locked,
+                 { run_writers(locked_write8, &sw); });
+    close_stream(sw.fs);
+    append_stream *as = as_open("out.txt", "w");
+    MEASURE_TIME(stream, append_stream_write8,
+                 { run_writers(append_write8, as); });
+    as_close(as);
+
+    // mostly zeros, with a page of data every megabyte
+    const size_t sparse_bytes = 64 << 20;
+    ofs = fs_open("sparse.txt", "w");
+    MEASURE_TIME(stream, file_stream_write8_zeros, {
+        for (size_t i = 0; i < sparse_bytes; i += 8) {
+            (*(uint64_t *)fs_write(ofs, 8)) = (i & ((1 << 20) - 1)) < 4096;
+        }
+    });
+    close_stream(ofs);
+    ofs = fs_open("sparse.txt", "ws");
+    MEASURE_TIME(stream, file_stream_write8_sparse, {
+        for (size_t i = 0; i < sparse_bytes; i += 8) {
+            (*(uint64_t *)fs_write(ofs, 8)) = (i & ((1 << 20) - 1)) < 4096;
+        }
+    });
+    close_stream(ofs);
+    fs = fs_open("sparse.txt", "r");
+    MEASURE_TIME(stream, file_stream_read_holes, {
+        size_t expected = 0;
+        while (fs_read(fs, 1 << 16, &expected) != NULL) {
+        }
+    });
+    close_stream(fs);
+    fs = fs_open("sparse.txt", "rs");
+    MEASURE_TIME(stream, file_stream_skip_holes, {
+        size_t expected = 0;
+        fs_extent e;
+        while (fs_extent_at(fs, &e) == 0) {
+            if (e.hole) {
+                fs_seek(fs, e.size, SEEK_CUR);
+            } else {
+                fs_read(fs, MIN(e.size, 1 << 16), &expected);
+            }
+        }
+    });
+    close_stream(fs);
+
     fs = fs_open("utf8.txt", "r");
     wchar_t *wline = 0;
     int line_len = 0;
@@ -319,6 +956,80 @@ int main()
     });
     close_stream(fs);
 
+    fs = fs_open("unicode16_be_bom.txt", "rt");
+    MEASURE_TIME(stream, file_stream_read_line_swapped, {
+        do {
+            line_len = fs_read_line(fs, (uint8_t **)&wline, UNICODE_16);
+        } while (line_len != 0);
+    });
+    close_stream(fs);
+
+    text_stream *ts = ts_open(test_file_path, "r", ASCII, UNICODE_16);
+    MEASURE_TIME(stream, text_stream_read_line_utf16, {
+        while (ts_read_line(ts, (uint8_t **)&wline)) {
+        }
+    });
+    ts_close(ts);
+
+    bit_stream *bs = bs_open("bits.bin", "w");
+    MEASURE_TIME(stream, bit_stream_write_per_bit, {
+        for (uint32_t i = 0; i < 1024 * 1024 * 4; i++) {
+            for (int b = 4; b >= 0; b--) {
+                bs_write(bs, (i >> b) & 1);
+            }
+        }
+    });
+    bs_close(bs);
+    bs = bs_open("bits.bin", "w");
+    MEASURE_TIME(stream, bit_stream_write_bits, {
+        for (uint32_t i = 0; i < 1024 * 1024 * 4; i++) {
+            bs_write_bits(bs, i, 5);
+        }
+    });
+    bs_close(bs);
+    bs = bs_open("bits.bin", "r");
+    uint64_t bit_sum = 0;
+    MEASURE_TIME(stream, bit_stream_read_per_bit, {
+        for (uint32_t i = 0; i < 1024 * 1024 * 4; i++) {
+            uint32_t v = 0;
+            for (int b = 0; b < 5; b++) {
+                v = (v << 1) | bs_read(bs);
+            }
+            bit_sum += v;
+        }
+    });
+    bs_close(bs);
+    bs = bs_open("bits.bin", "r");
+    MEASURE_TIME(stream, bit_stream_read_bits, {
+        for (uint32_t i = 0; i < 1024 * 1024 * 4; i++) {
+            bit_sum -= bs_read_bits(bs, 5);
+        }
+    });
+    bs_close(bs);
+    if (bit_sum != 0) {
+        printf("bit stream mismatch\n");
+    }
+
+    gen_test_file("test_64k.txt", 1024 * 64);
+    MEASURE_TIME(stream, file_stream_open_close, {
+        for (int i = 0; i < 10000; i++) {
+            fs = fs_open("test_64k.txt", "r");
+            fs_read(fs, 128, &expected);
+            close_stream(fs);
+        }
+    });
+    fs_allocator pool = fs_pool_allocator(0);
+    fs_set_allocator(&pool);
+    MEASURE_TIME(stream, file_stream_open_close_pooled, {
+        for (int i = 0; i < 10000; i++) {
+            fs = fs_open("test_64k.txt", "r");
+            fs_read(fs, 128, &expected);
+            close_stream(fs);
+        }
+    });
+    fs_set_allocator(NULL);
+    fs_pool_trim();
+
     END_TEST(stream, {});
 
     //